@@ -3,20 +3,46 @@
 #include <stdint.h>
 #include <stdbool.h>  // for 'true'
 #include <sys/time.h> // for gettimeofday()
-#include <unistd.h>   // for usleep()
+#include <time.h>     // for clock_gettime()
+#include <unistd.h>   // for usleep(), pread(), getopt()
+#include <fcntl.h>    // for open()
+#include <poll.h>     // for poll()
+#include <sys/ioctl.h> // for ioctl()
+#include <linux/fb.h>  // for FBIOGET_VSCREENINFO, FBIOGET_FSCREENINFO
 
 #include <string.h>
 
-#include <lz4.h> // for LZ4_compressBound, LZ4_compress_default, LZ4_decompress_safe
+#include <lz4.h>   // for LZ4_compressBound, LZ4_compress_fast, LZ4_decompress_safe
+#include <lz4hc.h> // for LZ4_compress_HC, LZ4HC_CLEVEL_DEFAULT
+
+// Build with -DWITH_ZSTD (and -lzstd) for the zstd compression backend.
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
 
 // #define VERBOSE
 
 // The lower two bits indicate the frame compression type
 // The third bit indicates whether it is partial.
+// The fourth to sixth bits indicate the codec used by compressed frames.
+// The seventh bit indicates a control frame that carries no pixel data.
 #define FRAME_TYPE_FULL 0
 #define FRAME_TYPE_RLE 1
-#define FRAME_TYPE_LZ4 2
-// #define FRAME_PARTIAL 4 // Future
+#define FRAME_TYPE_COMPRESSED 2
+#define FRAME_PARTIAL 4
+#define FRAME_CODEC_SHIFT 3
+#define FRAME_CODEC_MASK (7 << FRAME_CODEC_SHIFT)
+#define FRAME_TYPE_HEADER 64
+#define FRAME_TYPE_TILES 65
+#define FRAME_TYPE_END 66
+
+// Stream headers carry a magic number, so that the receiver can find the next one after
+// losing its place, and a sanity limit on the frame size. A header is the type byte, the
+// magic, then the width, height and bits per pixel.
+#define STREAM_MAGIC "rPst"
+#define STREAM_MAGIC_LENGTH 4
+#define STREAM_HEADER_SIZE (1 + STREAM_MAGIC_LENGTH + 3 * sizeof(uint32_t))
+#define STREAM_MAX_DIMENSION 8192
 
 #define SWAP(a, b, t) \
     {                 \
@@ -36,20 +62,166 @@
 
 #define RLE_TYPE ARRAY_TYPE
 
+// Pixel format, 16-bit RGB565 or 32-bit XRGB8888, chosen at build time with -DPIXEL_BITS=32.
+// The diff works on whole ARRAY_TYPE elements and doesn't care, but colourmap() and the
+// stream header do. The colour table is written in RGB565 either way.
+#ifndef PIXEL_BITS
+#define PIXEL_BITS 16
+#endif
+
+#define BYTES_PER_PIXEL (PIXEL_BITS / 8)
+#if PIXEL_BITS == 16
+#define PIXEL_TYPE uint16_t
+#define COLOUR(rgb565) (rgb565)
+#define NUT_FOURCC "RGB\x10" // rawvideo rgb565le
+#elif PIXEL_BITS == 32
+#define PIXEL_TYPE uint32_t
+#define COLOUR(rgb565) ((((((rgb565) >> 11) & 0x1f) * 255 / 31) << 16) | (((((rgb565) >> 5) & 0x3f) * 255 / 63) << 8) | (((rgb565) & 0x1f) * 255 / 31))
+#define NUT_FOURCC "BGR\x00" // rawvideo bgr0, which is XRGB8888 in little endian
+#else
+#error "Only 16 and 32 bit pixels are supported"
+#endif
+
+#if PIXEL_BITS > ARRAY_TYPE_LENGTH
+#error "Pixels can't be wider than the elements the diff works on"
+#endif
+
 // The maximum number of pixels different from the last frame to use RLE.
 // Changes beyond this pixel count will force a keyframe
 #define MAX_DELTAS_FOR_RLE 10000
 
+// Diffs too big for RLE are sent progressively, in slices of this many rows, nearest to
+// the most recent small change first. Each frame interval sends slices until either the
+// compressed byte budget or the fraction of the frame time allowed has been used.
+#define PROGRESSIVE_SLICE_ROWS 64
+#define PROGRESSIVE_BYTE_BUDGET 262144
+#define PROGRESSIVE_TIME_BUDGET 0.5
+
+// Both sides keep a cache of tiles, bands of this many rows, that have been sent before.
+// When a large change brings back a tile the receiver already has (such as when flipping
+// back to a page), it's loaded from the cache instead of being sent again. The encoder only
+// keeps the hashes, and decides which slot each tile goes in, so the two always agree.
+#define TILE_ROWS 16
+#define TILE_CACHE_SLOTS 1024
+#define TILE_OP_LOAD 0
+#define TILE_OP_STORE 1
+
+#if (PROGRESSIVE_SLICE_ROWS % TILE_ROWS) != 0
+#error "Progressive slices must be made up of whole tiles"
+#endif
+
+// The CPU governor keeps the encoder's share of the CPU under a budget by stepping through
+// throttling levels. Each level stretches the frame time, falls back to fast LZ4 with more
+// and more acceleration (trading ratio for speed), and shrinks the per-frame budget for
+// progressive slices. The level goes up when the smoothed CPU usage is over budget, and
+// down once it's comfortably under it.
+#define GOVERNOR_MAX_LEVEL 4
+#define GOVERNOR_SMOOTHING 0.3
+#define GOVERNOR_HEADROOM 0.7
+
+// Compression backends for compressed frames. LZ4-HC output is plain LZ4, so it's the LZ4
+// backend at a level above 0.
+#define CODEC_LZ4 0
+#define CODEC_ZSTD 1
+#define NUM_CODECS 2
+
+// Longest command line accepted on the control channel, longer lines are truncated.
+#define CONTROL_LINE_MAX 64
+
+// Seconds the decoder waits for a header after asking for a keyframe before asking again.
+#define RESYNC_TIMEOUT 2
+
 // Seconds between a statistics output from the decoder.
 #define STATS_INTERVAL 15
 
+// Where frames are captured from when no input is given.
+#define DEFAULT_INPUT "/dev/fb0"
+
+// Decoder output formats.
+// Raw frames are written at the same rate they arrive, whether they changed or not.
+// NUT frames carry their own timestamps, so frames identical to the last one are skipped.
+#define OUTPUT_RAW 0
+#define OUTPUT_NUT 1
+
+// NUT container constants, see https://ffmpeg.org/~michael/nut.txt
+#define NUT_FILE_ID "nut/multimedia container"
+#define NUT_MAIN_STARTCODE (0x7A561F5F04ADULL + (((uint64_t)(('N' << 8) + 'M')) << 48))
+#define NUT_STREAM_STARTCODE (0x11405BF2F9DBULL + (((uint64_t)(('N' << 8) + 'S')) << 48))
+#define NUT_SYNCPOINT_STARTCODE (0xE4ADEECA4569ULL + (((uint64_t)(('N' << 8) + 'K')) << 48))
+#define NUT_FLAG_KEY 1
+#define NUT_FLAG_CODED_PTS 8
+#define NUT_FLAG_SIZE_MSB 32
+#define NUT_FLAG_CHECKSUM 64
+#define NUT_FRAME_FLAGS (NUT_FLAG_KEY | NUT_FLAG_CODED_PTS | NUT_FLAG_SIZE_MSB | NUT_FLAG_CHECKSUM)
+#define NUT_MSB_PTS_SHIFT 7
+#define NUT_MAX_DISTANCE 32768
+
+// Framerates above this are taken to be a frame size, from when those were given.
+#define MAX_TARGET_FPS 1000
+
 // Target time per frame in seconds, the tool will sleep until at least this time has elapsed
 // before fetching the next frame.
 float FRAMETIME_TARGET = 0.2;
 
+// LZ4 acceleration factor, where 1 is the default and higher values compress faster but
+// not as well. The CPU governor raises this when throttling.
+int LZ4_ACCELERATION = 1;
+
+// The backend, and level, used to compress large changes. The CPU governor falls back to
+// fast LZ4 when throttling.
+int COMPRESSION_CODEC = CODEC_LZ4;
+int COMPRESSION_LEVEL = 0;
+
+// An optional dictionary, trained offline on frames from the tablet, that both sides load
+// to improve the compression of small slices. Only the zstd backend uses it.
+char *COMPRESSION_DICT = NULL;
+uint32_t COMPRESSION_DICT_SIZE = 0;
+
+// A rectangle of the framebuffer, in pixels.
+struct region_s
+{
+    uint32_t x, y, width, height;
+};
+
+// How frames are laid out in whatever they are captured from.
+struct geometry_s
+{
+    uint32_t width, height, bits_per_pixel; // Visible size, in pixels
+    uint32_t stride;                        // Bytes from the start of one row to the next
+    off_t offset;                           // Bytes before the first visible row
+    off_t frame_bytes;                      // Bytes from one captured frame to the next, or 0 for a live framebuffer
+};
+
+// Set FRAMETIME_TARGET from a target framerate, keeping it within reason.
+void set_target_fps(float target_fps)
+{
+    if (target_fps < 0.1)
+    {
+        fprintf(stderr, "For sanity, setting the target framerate to 0.2fps\n");
+        FRAMETIME_TARGET = 5.0;
+    }
+    else
+    {
+        FRAMETIME_TARGET = (target_fps > 0 ? 1 / target_fps : -1 / target_fps);
+    }
+}
+
+// Parse a WxH+X+Y region, returning false if it isn't one.
+bool parse_region(const char *arg, struct region_s *region)
+{
+    struct region_s parsed;
+    if ((sscanf(arg, "%ux%u+%u+%u", &parsed.width, &parsed.height, &parsed.x, &parsed.y) != 4) || (parsed.width == 0) || (parsed.height == 0))
+    {
+        return false;
+    }
+
+    *region = parsed;
+    return true;
+}
+
 struct colourmap_s
 {
-    uint16_t key, val;
+    PIXEL_TYPE key, val;
 };
 
 // A real quick little Wolfram function to convert an RGB colour into an RGB565 16-bit hex value
@@ -63,22 +235,23 @@ RGBtoRGB565 = Function[{r, g, b},
 
 const uint16_t NUM_COLOURMAPS = 4;
 const struct colourmap_s GREYVALUE_MAPPING[] = {
-    {0x9cd3, 0x001c}, // Blue pen, BUT ALSO PINK HIGHLIGHTER!
-    {0x52aa, 0xb800}, // Red pen
-    {0xd69a, 0xfff0}, // Yellow highlighter
-    {0xb5b6, 0x87f0}  // Green highlighter
+    {COLOUR(0x9cd3), COLOUR(0x001c)}, // Blue pen, BUT ALSO PINK HIGHLIGHTER!
+    {COLOUR(0x52aa), COLOUR(0xb800)}, // Red pen
+    {COLOUR(0xd69a), COLOUR(0xfff0)}, // Yellow highlighter
+    {COLOUR(0xb5b6), COLOUR(0x87f0)}  // Green highlighter
     //{0x9cd3, 0xfdfb}  // Pink highlighter, BUT ALSO BLUE PEN
 };
 
-#if ARRAY_TYPE_LENGTH == 16
+// Colour a row (or any run) of elements, specialised for how many pixels each element holds.
+#if ARRAY_TYPE_LENGTH == PIXEL_BITS
 uint32_t colourmap(ARRAY_TYPE *buf, ARRAY_TYPE *obuf, uint32_t array_size)
 {
     uint32_t num_pixels_mapped = 0;
 
-    for (uint32_t n = 0; n <= array_size; n++)
+    for (uint32_t n = 0; n < array_size; n++)
     {
         obuf[n] = buf[n];
-        for (int c = 0; c <= NUM_COLOURMAPS; c++)
+        for (int c = 0; c < NUM_COLOURMAPS; c++)
         {
             if (obuf[n] == GREYVALUE_MAPPING[c].key)
             {
@@ -90,12 +263,12 @@ uint32_t colourmap(ARRAY_TYPE *buf, ARRAY_TYPE *obuf, uint32_t array_size)
 
     return num_pixels_mapped;
 }
-#elif ARRAY_TYPE_LENGTH == 32
+#elif (ARRAY_TYPE_LENGTH == 32) && (PIXEL_BITS == 16)
 uint32_t colourmap(ARRAY_TYPE *buf, ARRAY_TYPE *obuf, uint32_t array_size)
 {
     uint32_t num_pixels_mapped = 0;
 
-    for (uint32_t n = 0; n <= array_size; n++)
+    for (uint32_t n = 0; n < array_size; n++)
     {
         obuf[n] = buf[n];
         for (int c = 0; c < NUM_COLOURMAPS; c++)
@@ -108,7 +281,7 @@ uint32_t colourmap(ARRAY_TYPE *buf, ARRAY_TYPE *obuf, uint32_t array_size)
             }
 
             // The high 16 bits
-            if ((obuf[n] & 0xffff0000) == GREYVALUE_MAPPING[c].key)
+            if ((obuf[n] >> 16) == GREYVALUE_MAPPING[c].key)
             {
                 obuf[n] = (obuf[n] & 0x0000ffff) + (GREYVALUE_MAPPING[c].val << 16);
                 num_pixels_mapped++;
@@ -124,317 +297,1250 @@ uint64_t time64()
 {
     struct timeval tv;
     gettimeofday(&tv, NULL);
-    return tv.tv_sec * 1000000 + tv.tv_usec;
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
 }
 
-// RLE Compress a buffer to OFP
-uint32_t write_frame_rle(ARRAY_TYPE *buf, uint32_t bufsize, FILE *ofp)
+// CPU time used by this process, in μs.
+uint64_t cputime64()
 {
-    RLE_TYPE *bufr = (RLE_TYPE *)buf;
-    RLE_TYPE last = bufr[0];
-    uint32_t count = 1;
-    uint32_t bytes_written = 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-    int8_t frame_type = FRAME_TYPE_RLE;
-    fwrite(&frame_type, 1, 1, ofp);
+struct governor_s
+{
+    float cpu_budget; // Fraction of a CPU the encoder may use, or 0 to never throttle
+    float cpu_usage;  // Smoothed fraction of a CPU used per frame interval
+    uint32_t level;   // Throttling level, 0 is unthrottled
+    uint64_t last_wall, last_cpu;
+};
+
+void governor_init(struct governor_s *gov, float cpu_budget)
+{
+    gov->cpu_budget = cpu_budget;
+    gov->cpu_usage = 0;
+    gov->level = 0;
+    gov->last_wall = time64();
+    gov->last_cpu = cputime64();
+}
 
-    for (uint32_t i = 1; i < (bufsize / sizeof(RLE_TYPE)); i++)
+// Account for the CPU used since the last update, including any time spent sleeping, and
+// move the throttling level if need be. Returns the (possibly new) throttling level.
+uint32_t governor_update(struct governor_s *gov)
+{
+    uint64_t wall = time64();
+    uint64_t cpu = cputime64();
+
+    if ((gov->cpu_budget <= 0) || (wall == gov->last_wall))
+    {
+        return gov->level;
+    }
+
+    float usage = (1.0 * (cpu - gov->last_cpu)) / (wall - gov->last_wall);
+    gov->cpu_usage = GOVERNOR_SMOOTHING * usage + (1 - GOVERNOR_SMOOTHING) * gov->cpu_usage;
+    gov->last_wall = wall;
+    gov->last_cpu = cpu;
+
+    uint32_t level = gov->level;
+    if ((gov->cpu_usage > gov->cpu_budget) && (level < GOVERNOR_MAX_LEVEL))
+    {
+        level++;
+    }
+    else if ((gov->cpu_usage < GOVERNOR_HEADROOM * gov->cpu_budget) && (level > 0))
     {
-        if ((bufr[i] == last) && (count <= (1 << 30)))
+        level--;
+    }
+
+    if (level != gov->level)
+    {
+        if (level > 0)
         {
-            count++;
+            fprintf(stderr, "Throttling at level %u, using %.1f%% CPU of a %.1f%% budget\n", level, 100 * gov->cpu_usage, 100 * gov->cpu_budget);
         }
         else
         {
-            fwrite(&count, sizeof(count), 1, ofp);
-            fwrite(&last, sizeof(RLE_TYPE), 1, ofp);
-            bytes_written += sizeof(count) + sizeof(RLE_TYPE);
-            last = bufr[i];
-            count = 1;
+            fprintf(stderr, "No longer throttling, using %.1f%% CPU of a %.1f%% budget\n", 100 * gov->cpu_usage, 100 * gov->cpu_budget);
         }
+        gov->level = level;
     }
 
-    fwrite(&count, sizeof(count), 1, ofp);
-    fwrite(&last, sizeof(RLE_TYPE), 1, ofp);
-    bytes_written += sizeof(count) + sizeof(RLE_TYPE);
-
-    // Indicate the end of RLE content with a 0-count
-    count = 0;
-    fwrite(&count, sizeof(count), 1, ofp);
-    fflush(ofp);
-    bytes_written += sizeof(count);
-
-    return bytes_written;
+    return level;
 }
 
-uint32_t write_frame_raw(ARRAY_TYPE *buf, uint32_t bufsize, FILE *ofp)
+// The receiver can steer the encoder with commands, one per line, on a control channel:
+//   k          Start over from a blank frame, for a receiver that joined late or lost data
+//   f <fps>    Change the target framerate
+//   r WxH+X+Y  Change the region of interest, or a bare r for the whole framebuffer
+//   p          Pause capture, such as while the viewer is minimized
+//   u          Resume capture
+struct control_s
 {
-    int8_t frame_type = FRAME_TYPE_FULL;
-    uint32_t bytes_written = 0;
-    bytes_written += fwrite(&frame_type, 1, 1, ofp);
-    bytes_written += bufsize * fwrite(buf, bufsize, 1, ofp);
-    fflush(ofp);
+    int fd; // -1 without a control channel
+    char line[CONTROL_LINE_MAX];
+    uint32_t line_len;
+    bool paused;
+    bool keyframe;
+    bool region_changed;
+    struct region_s region;
+};
 
-    return bytes_written;
+void control_init(struct control_s *ctl, int fd)
+{
+    memset(ctl, 0, sizeof(struct control_s));
+    ctl->fd = fd;
 }
 
-uint32_t write_frame_lz4(ARRAY_TYPE *buf, uint32_t bufsize, FILE *ofp)
+void control_command(struct control_s *ctl, const char *line)
 {
-    int8_t frame_type = FRAME_TYPE_LZ4;
-    uint32_t bytes_written = 0;
-    bytes_written += fwrite(&frame_type, 1, 1, ofp);
-
-    uint32_t decompressed_data_size = bufsize;
-    bytes_written += sizeof(decompressed_data_size) * fwrite(
-                                                          &decompressed_data_size, sizeof(decompressed_data_size), 1, stdout);
+    const char *arg = line + 1;
+    float target_fps;
 
-#ifdef VERBOSE
-    uint64_t dt = time64();
-#endif
-    uint32_t compressed_size_bound = LZ4_compressBound(decompressed_data_size);
-    char *compressed_data = (char *)malloc(compressed_size_bound);
-    uint32_t compressed_data_size = LZ4_compress_default(
-        (char *)buf,
-        compressed_data,
-        decompressed_data_size,
-        compressed_size_bound);
-#ifdef VERBOSE
-    dt = time64() - dt;
-    fprintf(stderr, "LZ4 compression of keyframe in %lu μs with ratio %f\n", dt, (1.0 * compressed_data_size) / decompressed_data_size);
-    dt = time64();
-#endif
-    bytes_written += sizeof(compressed_data_size) * fwrite(
-                                                        &compressed_data_size, sizeof(compressed_data_size), 1, stdout);
-    bytes_written += compressed_data_size * fwrite(compressed_data, compressed_data_size, 1, stdout);
-    free(compressed_data);
+    if (line[0] == 0)
+    {
+        return;
+    }
 
-#ifdef VERBOSE
-    dt = time64() - dt;
-    fprintf(stderr, "LZ4 compressed data transmitted in %lu μs\n", dt);
-    fprintf(stderr, "LZ4 frame write efficiency %f\n", (1.0 * bytes_written) / bufsize);
-#endif
+    while (*arg == ' ')
+    {
+        arg++;
+    }
 
-    return bytes_written;
+    switch (line[0])
+    {
+    case 'k':
+        ctl->keyframe = true;
+        break;
+    case 'f':
+        if (sscanf(arg, "%f", &target_fps) != 1)
+        {
+            fprintf(stderr, "Unable to parse control framerate %s\n", arg);
+            break;
+        }
+        set_target_fps(target_fps);
+        break;
+    case 'r':
+        // A region with no size means the whole framebuffer.
+        if (*arg == 0)
+        {
+            memset(&ctl->region, 0, sizeof(struct region_s));
+        }
+        else if (!parse_region(arg, &ctl->region))
+        {
+            fprintf(stderr, "Unable to parse control region %s, expected WxH+X+Y\n", arg);
+            break;
+        }
+        ctl->region_changed = true;
+        break;
+    case 'p':
+        if (!ctl->paused)
+        {
+            fprintf(stderr, "Pausing capture\n");
+        }
+        ctl->paused = true;
+        break;
+    case 'u':
+        if (ctl->paused)
+        {
+            fprintf(stderr, "Resuming capture\n");
+        }
+        ctl->paused = false;
+        break;
+    default:
+        fprintf(stderr, "Unknown control command %s\n", line);
+    }
 }
 
-uint32_t read_frame_rle(FILE *ifp, uint32_t bufsize, ARRAY_TYPE *buf)
+// Act on any commands waiting on the control channel. While capture is paused, this waits
+// for the command that resumes it, so a paused encoder costs nothing.
+void control_poll(struct control_s *ctl)
 {
-    uint32_t bytes_read = 0;
-    uint32_t buf_cursor = 0;
-
-    uint32_t count;
-    RLE_TYPE value;
-
-    bytes_read += sizeof(count) * fread(&count, sizeof(count), 1, ifp);
+    struct pollfd pfd = {.fd = ctl->fd, .events = POLLIN};
+    char chunk[256];
 
-    while (count != 0)
+    while (ctl->fd >= 0)
     {
-        bytes_read += sizeof(RLE_TYPE) * fread(&value, sizeof(RLE_TYPE), 1, ifp);
-        for (; (count > 0) && (buf_cursor < (bufsize / sizeof(ARRAY_TYPE))); count--)
+        int ready = poll(&pfd, 1, (ctl->paused ? -1 : 0));
+        if (ready == 0)
         {
-            buf[buf_cursor++] = value;
+            break;
         }
 
-        bytes_read += sizeof(count) * fread(&count, sizeof(count), 1, ifp);
-    }
+        ssize_t numread = (ready > 0 ? read(ctl->fd, chunk, sizeof(chunk)) : -1);
+        if (numread <= 0)
+        {
+            // Nobody is left to resume capture, so carry on without the channel.
+            fprintf(stderr, "Control channel closed\n");
+            ctl->fd = -1;
+            ctl->paused = false;
+            break;
+        }
 
-#ifdef VERBOSE
-    fprintf(stderr, "RLE frame efficiency %f\n", (1.0 * bytes_read) / bufsize);
-#endif
-    return bytes_read;
+        for (ssize_t i = 0; i < numread; i++)
+        {
+            if (chunk[i] == '\n')
+            {
+                ctl->line[ctl->line_len] = 0;
+                control_command(ctl, ctl->line);
+                ctl->line_len = 0;
+            }
+            else if (ctl->line_len < CONTROL_LINE_MAX - 1)
+            {
+                ctl->line[ctl->line_len++] = chunk[i];
+            }
+        }
+    }
 }
 
-uint32_t read_frame_lz4(FILE *ifp, uint32_t bufsize, ARRAY_TYPE *buf)
+struct tile_op_s
 {
-    uint32_t bytes_read = 0;
-    uint32_t source_data_size;
-    uint32_t compressed_data_size;
-
-#ifdef VERBOSE
-    uint64_t dt = time64();
-#endif
+    uint32_t op, slot, tile;
+};
 
-    bytes_read += sizeof(source_data_size) * fread(
-                                                 &source_data_size, sizeof(source_data_size), 1, ifp);
-    bytes_read += sizeof(compressed_data_size) * fread(
-                                                     &compressed_data_size, sizeof(compressed_data_size), 1, ifp);
+// The encoder's view of the receiver's tile cache.
+struct tile_cache_s
+{
+    uint64_t hash[TILE_CACHE_SLOTS];
+    uint64_t last_used[TILE_CACHE_SLOTS]; // 0 for empty slots
+    uint64_t clock;
+};
 
-    char *compressed_data = (char *)malloc(compressed_data_size);
-    bytes_read += compressed_data_size * fread(compressed_data, compressed_data_size, 1, ifp);
-#ifdef VERBOSE
-    dt = time64() - dt;
-    fprintf(stderr, "LZ4 compressed data received in %lu μs\n", dt);
-    dt = time64();
-#endif
-    uint32_t decompressed_data_size = LZ4_decompress_safe(
-        compressed_data, (char *)buf, compressed_data_size, source_data_size);
-    free(compressed_data);
+// The receiver's tile cache, with the pixels for each slot.
+struct tile_slots_s
+{
+    ARRAY_TYPE *data[TILE_CACHE_SLOTS];
+    uint32_t len[TILE_CACHE_SLOTS];
+};
 
-#ifdef VERBOSE
-    dt = time64() - dt;
-    fprintf(stderr, "LZ4 decompression of keyframe in %lu μs with ratio %f\n", dt, (1.0 * compressed_data_size) / decompressed_data_size);
-    fprintf(stderr, "LZ4 frame efficiency %f\n", (1.0 * bytes_read) / bufsize);
-#endif
-    return bytes_read;
+// The start and length, in elements, of a tile. The last tile may be short.
+uint32_t tile_span(uint32_t tile, uint32_t tile_elems, uint32_t nelems, uint32_t *start_p)
+{
+    *start_p = tile * tile_elems;
+    return (*start_p + tile_elems < nelems ? tile_elems : nelems - *start_p);
 }
 
-uint32_t read_frame(FILE *ifp, uint32_t bufsize, ARRAY_TYPE *buf, int8_t *frame_type_p)
+// FNV-1a over whole elements, with a final avalanche so that similar tiles don't end up
+// with similar hashes. The length is mixed in so short tiles can't match full ones.
+uint64_t tile_hash(ARRAY_TYPE *buf, uint32_t nelems)
 {
-    // Read the header byte
-    int8_t frame_type = -1;
-    if (fread(&frame_type, 1, 1, ifp) == 0)
+    uint64_t h = 0xcbf29ce484222325ULL ^ nelems;
+
+    for (uint32_t i = 0; i < nelems; i++)
     {
-        *frame_type_p = frame_type;
-        return 0;
+        h = (h ^ buf[i]) * 0x100000001b3ULL;
     }
 
-#ifdef VERBOSE
-    fprintf(stderr, "Incoming frame type %d\n", frame_type);
-#endif
-    *frame_type_p = frame_type;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
 
-    switch (frame_type)
-    {
-    case 0:
-    {
-#ifdef VERBOSE
-        uint64_t dtr = time64();
-#endif
-        uint32_t num_read = fread(buf, bufsize, 1, ifp);
-#ifdef VERBOSE
-        fprintf(stderr, "Took %lu μs to read %lu bytes of keyframe\n", time64() - dtr, num_read * sizeof(ARRAY_TYPE));
-#endif
-        return num_read * sizeof(ARRAY_TYPE);
-    }
-    case 1:
-    {
-#ifdef VERBOSE
-        uint64_t dtr = time64();
-#endif
-        uint32_t num_read = read_frame_rle(ifp, bufsize, buf);
-#ifdef VERBOSE
-        fprintf(stderr, "Took %lu μs to read %lu bytes of RLE frame\n", time64() - dtr, num_read);
-#endif
-        return num_read;
-    }
-    case 2:
-    {
-#ifdef VERBOSE
-        uint64_t dtr = time64();
-#endif
-        uint32_t num_read = read_frame_lz4(ifp, bufsize, buf);
-#ifdef VERBOSE
-        fprintf(stderr, "Took %lu μs to read %lu bytes of LZ4 frame\n", time64() - dtr, num_read);
-#endif
-        return num_read;
-    }
-    default:
-        fprintf(stderr, "Unknown frame header %d\n", frame_type);
-        return 0;
-    }
+    return h;
 }
 
-void encode(uint32_t bytes_per_block)
+// Find the slot holding a hash, or -1.
+int32_t tile_cache_find(struct tile_cache_s *cache, uint64_t hash)
 {
-    // FILE *ifp = stdin;
-    FILE *ifp = fopen("/dev/fb0", "rb");
-    FILE *ofp = stdout;
-    uint32_t nelems = bytes_per_block / sizeof(ARRAY_TYPE);
-    uint64_t t0 = time64();
-    uint64_t dt = t0;
-    uint32_t num_frames = 0;
-
-    //TODO: Handle when bytes_per_block is not a multiple of sizeof(ARRAY_TYPE)
-    if ((bytes_per_block % sizeof(ARRAY_TYPE)) != 0)
+    for (int32_t slot = 0; slot < TILE_CACHE_SLOTS; slot++)
     {
-        fprintf(stderr, "Input block size is not divisible by %d, the number of bytes per chunk, extra bytes aren't supported yet\n", (int)sizeof(ARRAY_TYPE));
-        exit(63);
+        if ((cache->last_used[slot] != 0) && (cache->hash[slot] == hash))
+        {
+            return slot;
+        }
     }
 
-    // Allocate two buffers, one for the last frame, and one for this frame.
-    ARRAY_TYPE *buf_a = (ARRAY_TYPE *)malloc(bytes_per_block);
-    ARRAY_TYPE *buf_b = (ARRAY_TYPE *)malloc(bytes_per_block);
-    ARRAY_TYPE *buf_diff = (ARRAY_TYPE *)malloc(bytes_per_block);
-    ARRAY_TYPE *buf_tmp = NULL;
+    return -1;
+}
 
-    // Prime the pump;
-    uint32_t numread = fread(buf_a, bytes_per_block, 1, ifp);
-    fseek(ifp, 0, SEEK_SET);
+// For every tile that changed, check whether the new content is already in the receiver's
+// cache. If it is, a load is added to ops, and the tile's diff is cleared so it isn't also
+// sent as pixels. The hashes of all changed tiles are left in tile_hashes for
+// tile_cache_store(). Returns the number of ops.
+uint32_t tile_cache_match(struct tile_cache_s *cache, ARRAY_TYPE *shadow, ARRAY_TYPE *cur, uint32_t nelems, uint32_t tile_elems, uint32_t *tile_deltas, uint64_t *tile_hashes, struct tile_op_s *ops)
+{
+    uint32_t num_tiles = (nelems + tile_elems - 1) / tile_elems;
+    uint32_t num_ops = 0;
 
-#ifdef VERBOSE
+    for (uint32_t tile = 0; tile < num_tiles; tile++)
     {
-        fprintf(stderr, "Starting first LZ4 keyframe\n");
-        fflush(stdout);
-        uint64_t dt = time64();
-#endif
-        write_frame_lz4(buf_a, bytes_per_block, ofp);
-#ifdef VERBOSE
-        dt = time64() - dt;
-        fprintf(stderr, "Done first LZ4 keyframe in %lu μs\n", dt);
-        fflush(stdout);
-    }
-#endif
-    num_frames++;
-    SWAP(buf_a, buf_b, buf_tmp);
-    dt = time64() - dt;
+        if (tile_deltas[tile] == 0)
+        {
+            continue;
+        }
 
-#ifdef VERBOSE
-    fprintf(stderr, "Finished setting up encoder in %lu μs\n", dt);
-#endif
+        uint32_t start;
+        uint32_t len = tile_span(tile, tile_elems, nelems, &start);
+        tile_hashes[tile] = tile_hash(shadow + start, len);
 
-    while (true)
-    {
-        dt = time64();
-        if ((num_frames % 30) == 0)
+        int32_t slot = tile_cache_find(cache, tile_hashes[tile]);
+        if (slot >= 0)
         {
-            fprintf(stderr, "%f\n", 1000000.0 * num_frames / (dt - t0));
-            num_frames = 1;
-            t0 = dt;
+            cache->last_used[slot] = ++cache->clock;
+            ops[num_ops++] = (struct tile_op_s){TILE_OP_LOAD, slot, tile};
+            memset(cur + start, 0, len * sizeof(ARRAY_TYPE));
+            tile_deltas[tile] = 0;
         }
+    }
 
-        // Read the new frame, the last frame is in buf_b
-        numread = fread(buf_a, bytes_per_block, 1, ifp);
-        fseek(ifp, 0, SEEK_SET);
+    return num_ops;
+}
 
-        // numread = raw_read(buf_a, bytes_per_block);
-        if (numread == 0)
+// Once the tiles in the sent slices have reached the receiver, have it cache them too,
+// evicting the least recently used tiles to make room. Returns the number of ops.
+uint32_t tile_cache_store(struct tile_cache_s *cache, uint32_t num_tiles, uint32_t *tile_deltas, uint64_t *tile_hashes, uint8_t *slice_sent, struct tile_op_s *ops)
+{
+    uint32_t num_ops = 0;
+
+    for (uint32_t tile = 0; tile < num_tiles; tile++)
+    {
+        if ((tile_deltas[tile] == 0) || !slice_sent[tile / (PROGRESSIVE_SLICE_ROWS / TILE_ROWS)] || (tile_cache_find(cache, tile_hashes[tile]) >= 0))
         {
-            break;
+            continue;
         }
 
-        // Now run through and fwrite each element
-        uint32_t num_deltas = 0;
-        for (uint32_t i = 0; i < nelems; i++)
+        uint32_t slot = 0;
+        for (uint32_t s = 1; s < TILE_CACHE_SLOTS; s++)
         {
-            buf_diff[i] = buf_a[i] ^ buf_b[i];
-            if (buf_diff[i] != 0)
+            if (cache->last_used[s] < cache->last_used[slot])
             {
-                num_deltas++;
+                slot = s;
             }
         }
 
+        cache->hash[slot] = tile_hashes[tile];
+        cache->last_used[slot] = ++cache->clock;
+        ops[num_ops++] = (struct tile_op_s){TILE_OP_STORE, slot, tile};
+    }
+
+    return num_ops;
+}
+
+uint32_t write_frame_tiles(struct tile_op_s *ops, uint32_t num_ops, FILE *ofp)
+{
+    int8_t frame_type = FRAME_TYPE_TILES;
+    uint32_t bytes_written = 0;
+
+    bytes_written += fwrite(&frame_type, 1, 1, ofp);
+    bytes_written += sizeof(num_ops) * fwrite(&num_ops, sizeof(num_ops), 1, ofp);
+    bytes_written += num_ops * sizeof(struct tile_op_s) * fwrite(ops, num_ops * sizeof(struct tile_op_s), 1, ofp);
+    fflush(ofp);
+
+    return bytes_written;
+}
+
+// Apply the tile cache ops in a tiles frame. Stores copy tiles of the current frame into
+// the cache. Loads are turned into a diff against the current frame, so that they're
+// applied like any other frame, and the span of the diff covers all of the loaded tiles.
+uint32_t read_frame_tiles(FILE *ifp, uint32_t bufsize, ARRAY_TYPE *buf, ARRAY_TYPE *frame, uint32_t tile_elems, struct tile_slots_s *slots, uint32_t *span_offset_p, uint32_t *span_length_p)
+{
+    uint32_t nelems = bufsize / sizeof(ARRAY_TYPE);
+    uint32_t num_tiles = (nelems + tile_elems - 1) / tile_elems;
+    uint32_t span_start = nelems, span_end = 0;
+    uint32_t num_ops;
+    struct tile_op_s op;
+
+    if (fread(&num_ops, sizeof(num_ops), 1, ifp) == 0)
+    {
+        return 0;
+    }
+
+    for (uint32_t n = 0; n < num_ops; n++)
+    {
+        if ((fread(&op, sizeof(op), 1, ifp) == 0) || (op.slot >= TILE_CACHE_SLOTS) || (op.tile >= num_tiles) ||
+            ((op.op != TILE_OP_LOAD) && (op.op != TILE_OP_STORE)))
+        {
+            fprintf(stderr, "Bad tile cache op\n");
+            return 0;
+        }
+
+        uint32_t start;
+        uint32_t len = tile_span(op.tile, tile_elems, nelems, &start);
+
+        if (op.op == TILE_OP_STORE)
+        {
+            if (slots->data[op.slot] == NULL)
+            {
+                slots->data[op.slot] = (ARRAY_TYPE *)malloc(tile_elems * sizeof(ARRAY_TYPE));
+            }
+            memcpy(slots->data[op.slot], frame + start, len * sizeof(ARRAY_TYPE));
+            slots->len[op.slot] = len;
+            continue;
+        }
+
+        if ((slots->data[op.slot] == NULL) || (slots->len[op.slot] != len))
+        {
+            fprintf(stderr, "Tile cache slot %u can't be loaded into tile %u\n", op.slot, op.tile);
+            return 0;
+        }
+
+        // Anything between this tile and the span so far isn't changing.
+        if (span_start > span_end)
+        {
+            span_start = start;
+            span_end = start;
+        }
+        if (start < span_start)
+        {
+            memset(buf + start + len, 0, (span_start - start - len) * sizeof(ARRAY_TYPE));
+            span_start = start;
+        }
+        if (start >= span_end)
+        {
+            memset(buf + span_end, 0, (start - span_end) * sizeof(ARRAY_TYPE));
+            span_end = start + len;
+        }
+
+        for (uint32_t i = 0; i < len; i++)
+        {
+            buf[start + i] = slots->data[op.slot][i] ^ frame[start + i];
+        }
+    }
+
+    *span_offset_p = (span_start < span_end ? span_start : 0) * sizeof(ARRAY_TYPE);
+    *span_length_p = (span_start < span_end ? span_end - span_start : 0) * sizeof(ARRAY_TYPE);
+
+    return sizeof(num_ops) + num_ops * sizeof(op);
+}
+
+// Write the stream header, which describes the size of the frames that follow.
+uint32_t write_stream_header(uint32_t width, uint32_t height, FILE *ofp)
+{
+    int8_t frame_type = FRAME_TYPE_HEADER;
+    uint32_t header[3] = {width, height, 8 * BYTES_PER_PIXEL};
+    uint32_t bytes_written = 0;
+
+    bytes_written += fwrite(&frame_type, 1, 1, ofp);
+    bytes_written += STREAM_MAGIC_LENGTH * fwrite(STREAM_MAGIC, STREAM_MAGIC_LENGTH, 1, ofp);
+    bytes_written += sizeof(header) * fwrite(header, sizeof(header), 1, ofp);
+    fflush(ofp);
+
+    return bytes_written;
+}
+
+// Mark the end of a frame interval that was sent as several partial and tiles frames, so
+// the receiver knows the frame is complete.
+uint32_t write_frame_end(FILE *ofp)
+{
+    int8_t frame_type = FRAME_TYPE_END;
+    uint32_t bytes_written = fwrite(&frame_type, 1, 1, ofp);
+    fflush(ofp);
+
+    return bytes_written;
+}
+
+// Parse the STREAM_HEADER_SIZE bytes of a stream header, returning false if they aren't
+// one. The pixel format isn't checked, as that's up to whoever wants the frames.
+bool parse_stream_header(const uint8_t *bytes, uint32_t *width_p, uint32_t *height_p, uint32_t *bits_per_pixel_p)
+{
+    uint32_t header[3];
+
+    if ((bytes[0] != FRAME_TYPE_HEADER) || (memcmp(bytes + 1, STREAM_MAGIC, STREAM_MAGIC_LENGTH) != 0))
+    {
+        return false;
+    }
+
+    memcpy(header, bytes + 1 + STREAM_MAGIC_LENGTH, sizeof(header));
+    if ((header[0] == 0) || (header[0] > STREAM_MAX_DIMENSION) || (header[1] == 0) || (header[1] > STREAM_MAX_DIMENSION) ||
+        (header[2] == 0) || (header[2] > 32) || ((header[2] % 8) != 0))
+    {
+        return false;
+    }
+
+    *width_p = header[0];
+    *height_p = header[1];
+    *bits_per_pixel_p = header[2];
+    return true;
+}
+
+// Work out the geometry of the capture source. Framebuffers are asked, and anything else,
+// such as a file of captured frames, has to start with a stream header describing the
+// packed frames that follow it. Returns false if the geometry can't be found.
+bool read_geometry(int fd, struct geometry_s *geom)
+{
+    struct fb_var_screeninfo vinfo;
+    struct fb_fix_screeninfo finfo;
+
+    if ((ioctl(fd, FBIOGET_VSCREENINFO, &vinfo) == 0) && (ioctl(fd, FBIOGET_FSCREENINFO, &finfo) == 0))
+    {
+        geom->width = vinfo.xres;
+        geom->height = vinfo.yres;
+        geom->bits_per_pixel = vinfo.bits_per_pixel;
+        geom->stride = finfo.line_length;
+        geom->offset = (off_t)vinfo.yoffset * finfo.line_length + vinfo.xoffset * vinfo.bits_per_pixel / 8;
+        geom->frame_bytes = 0;
+        return true;
+    }
+
+    uint8_t header[STREAM_HEADER_SIZE];
+    if ((pread(fd, header, sizeof(header), 0) != sizeof(header)) ||
+        !parse_stream_header(header, &geom->width, &geom->height, &geom->bits_per_pixel))
+    {
+        return false;
+    }
+
+    geom->stride = geom->width * geom->bits_per_pixel / 8;
+    geom->offset = sizeof(header);
+    geom->frame_bytes = (off_t)geom->height * geom->stride;
+    return true;
+}
+
+// Bytes from the start of the first row of a region to the end of its last row.
+uint32_t region_span_bytes(struct region_s *region, struct geometry_s *geom)
+{
+    return (region->height - 1) * geom->stride + region->width * BYTES_PER_PIXEL;
+}
+
+// Read a region of the framebuffer into buf, with the rows packed together. Rows in the
+// framebuffer are geom->stride bytes apart, so everything from the start of the first row
+// to the end of the last is read in one go, and the rows are then moved up to close the
+// gaps, which means buf has to hold region_span_bytes(). Returns the number of bytes of
+// packed rows read, or 0 if the whole region couldn't be read.
+uint32_t read_region(int fd, struct region_s *region, struct geometry_s *geom, ARRAY_TYPE *buf)
+{
+    uint32_t row_bytes = region->width * BYTES_PER_PIXEL;
+    uint32_t stride = geom->stride;
+    uint32_t span_bytes = region_span_bytes(region, geom);
+    off_t offset = geom->offset + (off_t)region->y * stride + region->x * BYTES_PER_PIXEL;
+
+    ssize_t numread = pread(fd, buf, span_bytes, offset);
+    if (numread != span_bytes)
+    {
+        return 0;
+    }
+
+    if (row_bytes != stride)
+    {
+        for (uint32_t row = 1; row < region->height; row++)
+        {
+            memmove((uint8_t *)buf + row * row_bytes, (uint8_t *)buf + row * stride, row_bytes);
+        }
+    }
+
+    return row_bytes * region->height;
+}
+
+uint32_t write_frame_raw(ARRAY_TYPE *buf, uint32_t bufsize, FILE *ofp)
+{
+    int8_t frame_type = FRAME_TYPE_FULL;
+    uint32_t bytes_written = 0;
+    bytes_written += fwrite(&frame_type, 1, 1, ofp);
+    bytes_written += bufsize * fwrite(buf, bufsize, 1, ofp);
+    fflush(ofp);
+
+    return bytes_written;
+}
+
+int lz4_compress(const char *src, char *dst, uint32_t src_size, uint32_t dst_capacity, int level)
+{
+    // Level 0 and below is the fast compressor, anything higher is LZ4-HC at that level.
+    if (level > 0)
+    {
+        return LZ4_compress_HC(src, dst, src_size, dst_capacity, level);
+    }
+    return LZ4_compress_fast(src, dst, src_size, dst_capacity, LZ4_ACCELERATION);
+}
+
+int lz4_decompress(const char *src, char *dst, uint32_t src_size, uint32_t dst_capacity)
+{
+    return LZ4_decompress_safe(src, dst, src_size, dst_capacity);
+}
+
+uint32_t lz4_compress_bound(uint32_t src_size)
+{
+    return LZ4_compressBound(src_size);
+}
+
+#ifdef WITH_ZSTD
+int zstd_compress(const char *src, char *dst, uint32_t src_size, uint32_t dst_capacity, int level)
+{
+    static ZSTD_CCtx *cctx = NULL;
+    static ZSTD_CDict *cdict = NULL;
+    static int cdict_level = 0;
+
+    if (cctx == NULL)
+    {
+        cctx = ZSTD_createCCtx();
+    }
+
+    // The dictionary is digested once per compression level, rather than once per frame.
+    if ((COMPRESSION_DICT != NULL) && ((cdict == NULL) || (cdict_level != level)))
+    {
+        ZSTD_freeCDict(cdict);
+        cdict = ZSTD_createCDict(COMPRESSION_DICT, COMPRESSION_DICT_SIZE, level);
+        cdict_level = level;
+    }
+
+    size_t compressed_size = (cdict != NULL ? ZSTD_compress_usingCDict(cctx, dst, dst_capacity, src, src_size, cdict)
+                                            : ZSTD_compressCCtx(cctx, dst, dst_capacity, src, src_size, level));
+    if (ZSTD_isError(compressed_size))
+    {
+        fprintf(stderr, "zstd compression failed: %s\n", ZSTD_getErrorName(compressed_size));
+        return 0;
+    }
+    return compressed_size;
+}
+
+int zstd_decompress(const char *src, char *dst, uint32_t src_size, uint32_t dst_capacity)
+{
+    static ZSTD_DCtx *dctx = NULL;
+    static ZSTD_DDict *ddict = NULL;
+
+    if (dctx == NULL)
+    {
+        dctx = ZSTD_createDCtx();
+        if (COMPRESSION_DICT != NULL)
+        {
+            ddict = ZSTD_createDDict(COMPRESSION_DICT, COMPRESSION_DICT_SIZE);
+        }
+    }
+
+    size_t decompressed_size = (ddict != NULL ? ZSTD_decompress_usingDDict(dctx, dst, dst_capacity, src, src_size, ddict)
+                                              : ZSTD_decompressDCtx(dctx, dst, dst_capacity, src, src_size));
+    if (ZSTD_isError(decompressed_size))
+    {
+        fprintf(stderr, "zstd decompression failed: %s\n", ZSTD_getErrorName(decompressed_size));
+        return -1;
+    }
+    return decompressed_size;
+}
+
+uint32_t zstd_compress_bound(uint32_t src_size)
+{
+    return ZSTD_compressBound(src_size);
+}
+#endif
+
+// A compression backend. compress() returns the compressed size, or 0 on failure, and
+// decompress() returns the decompressed size, or a negative value on failure.
+struct codec_s
+{
+    const char *name;
+    uint32_t (*compress_bound)(uint32_t src_size);
+    int (*compress)(const char *src, char *dst, uint32_t src_size, uint32_t dst_capacity, int level);
+    int (*decompress)(const char *src, char *dst, uint32_t src_size, uint32_t dst_capacity);
+};
+
+const struct codec_s CODECS[NUM_CODECS] = {
+    {"lz4", lz4_compress_bound, lz4_compress, lz4_decompress},
+#ifdef WITH_ZSTD
+    {"zstd", zstd_compress_bound, zstd_compress, zstd_decompress},
+#else
+    {"zstd", NULL, NULL, NULL},
+#endif
+};
+
+// Write the compressed body of a frame, which is the decompressed size, the compressed
+// size, and the compressed data.
+uint32_t write_compressed_payload(int codec, int level, ARRAY_TYPE *buf, uint32_t bufsize, FILE *ofp)
+{
+    uint32_t bytes_written = 0;
+
+    uint32_t decompressed_data_size = bufsize;
+    bytes_written += sizeof(decompressed_data_size) * fwrite(
+                                                          &decompressed_data_size, sizeof(decompressed_data_size), 1, ofp);
+
+#ifdef VERBOSE
+    uint64_t dt = time64();
+#endif
+    uint32_t compressed_size_bound = CODECS[codec].compress_bound(decompressed_data_size);
+    char *compressed_data = (char *)malloc(compressed_size_bound);
+    uint32_t compressed_data_size = CODECS[codec].compress(
+        (char *)buf,
+        compressed_data,
+        decompressed_data_size,
+        compressed_size_bound,
+        level);
+#ifdef VERBOSE
+    dt = time64() - dt;
+    fprintf(stderr, "%s compression of keyframe in %lu μs with ratio %f\n", CODECS[codec].name, dt, (1.0 * compressed_data_size) / decompressed_data_size);
+    dt = time64();
+#endif
+    bytes_written += sizeof(compressed_data_size) * fwrite(
+                                                        &compressed_data_size, sizeof(compressed_data_size), 1, ofp);
+    bytes_written += compressed_data_size * fwrite(compressed_data, compressed_data_size, 1, ofp);
+    free(compressed_data);
+
+#ifdef VERBOSE
+    dt = time64() - dt;
+    fprintf(stderr, "%s compressed data transmitted in %lu μs\n", CODECS[codec].name, dt);
+    fprintf(stderr, "%s frame write efficiency %f\n", CODECS[codec].name, (1.0 * bytes_written) / bufsize);
+#endif
+
+    return bytes_written;
+}
+
+uint32_t write_frame_compressed(int codec, int level, ARRAY_TYPE *buf, uint32_t bufsize, FILE *ofp)
+{
+    int8_t frame_type = FRAME_TYPE_COMPRESSED | (codec << FRAME_CODEC_SHIFT);
+    uint32_t bytes_written = 0;
+    bytes_written += fwrite(&frame_type, 1, 1, ofp);
+    bytes_written += write_compressed_payload(codec, level, buf, bufsize, ofp);
+    fflush(ofp);
+
+    return bytes_written;
+}
+
+// Write a compressed frame that only covers bufsize bytes of the diff, starting offset bytes in.
+uint32_t write_frame_compressed_partial(int codec, int level, ARRAY_TYPE *buf, uint32_t offset, uint32_t bufsize, FILE *ofp)
+{
+    int8_t frame_type = FRAME_TYPE_COMPRESSED | FRAME_PARTIAL | (codec << FRAME_CODEC_SHIFT);
+    uint32_t bytes_written = 0;
+    bytes_written += fwrite(&frame_type, 1, 1, ofp);
+    bytes_written += sizeof(offset) * fwrite(&offset, sizeof(offset), 1, ofp);
+    bytes_written += write_compressed_payload(codec, level, buf + offset / sizeof(ARRAY_TYPE), bufsize, ofp);
+    fflush(ofp);
+
+    return bytes_written;
+}
+
+// RLE output accumulated in memory during the diff pass, so that the choice between RLE
+// and LZ4 can be made once the pass is done, without a second pass over the diff.
+struct rle_output_s
+{
+    uint8_t *data;
+    uint32_t len;
+    RLE_TYPE last;
+    uint32_t count;
+};
+
+// Every delta can end at most two runs, so this many deltas can never overflow the buffer.
+#define RLE_OUTPUT_CAPACITY ((2 * MAX_DELTAS_FOR_RLE + 2) * (sizeof(uint32_t) + sizeof(RLE_TYPE)))
+
+void rle_output_push(struct rle_output_s *rle)
+{
+    memcpy(rle->data + rle->len, &rle->count, sizeof(rle->count));
+    memcpy(rle->data + rle->len + sizeof(rle->count), &rle->last, sizeof(RLE_TYPE));
+    rle->len += sizeof(rle->count) + sizeof(RLE_TYPE);
+}
+
+// Add count elements of the same value to the RLE encoding.
+void rle_output_run(struct rle_output_s *rle, RLE_TYPE value, uint32_t count)
+{
+    if ((rle->count > 0) && ((value != rle->last) || (rle->count + count > (1 << 30))))
+    {
+        rle_output_push(rle);
+        rle->count = 0;
+    }
+
+    rle->last = value;
+    rle->count += count;
+}
+
+// In a single pass, diff the newly captured frame in cur against the shadow of what the
+// receiver has, leaving the XOR diff in cur and updating the shadow in place to the new
+// frame. The diff is RLE encoded into rle as it goes, for as long as there are fewer than
+// MAX_DELTAS_FOR_RLE deltas, and the deltas in each tile of TILE_ROWS rows are counted
+// into tile_deltas. Most rows don't change from one frame to the next, so rows that are
+// the same as the shadow are skipped over whole. Returns the number of deltas.
+uint32_t diff_and_encode(ARRAY_TYPE *cur, ARRAY_TYPE *shadow, uint32_t row_elems, uint32_t num_rows, uint32_t *tile_deltas, struct rle_output_s *rle)
+{
+    uint32_t num_deltas = 0;
+    uint32_t tile_start_deltas = 0;
+
+    rle->len = 0;
+    rle->last = 0;
+    rle->count = 0;
+
+    for (uint32_t row = 0; row < num_rows; row++)
+    {
+        ARRAY_TYPE *cur_row = cur + row * row_elems;
+        ARRAY_TYPE *shadow_row = shadow + row * row_elems;
+
+        if (memcmp(cur_row, shadow_row, row_elems * sizeof(ARRAY_TYPE)) == 0)
+        {
+            memset(cur_row, 0, row_elems * sizeof(ARRAY_TYPE));
+            if (num_deltas < MAX_DELTAS_FOR_RLE)
+            {
+                rle_output_run(rle, 0, row_elems);
+            }
+        }
+        else
+        {
+            for (uint32_t i = 0; i < row_elems; i++)
+            {
+                ARRAY_TYPE delta = cur_row[i] ^ shadow_row[i];
+                if (delta != 0)
+                {
+                    shadow_row[i] = cur_row[i];
+                    num_deltas++;
+                }
+                cur_row[i] = delta;
+
+                if (num_deltas < MAX_DELTAS_FOR_RLE)
+                {
+                    rle_output_run(rle, delta, 1);
+                }
+            }
+        }
+
+        if ((((row + 1) % TILE_ROWS) == 0) || (row + 1 == num_rows))
+        {
+            tile_deltas[row / TILE_ROWS] = num_deltas - tile_start_deltas;
+            tile_start_deltas = num_deltas;
+        }
+    }
+
+    if (num_deltas < MAX_DELTAS_FOR_RLE)
+    {
+        rle_output_push(rle);
+    }
+
+    return num_deltas;
+}
+
+// Write out the RLE frame accumulated by diff_and_encode(), as (count, value) pairs ending
+// with a 0 count.
+uint32_t write_frame_rle_output(struct rle_output_s *rle, FILE *ofp)
+{
+    int8_t frame_type = FRAME_TYPE_RLE;
+    uint32_t count = 0;
+    uint32_t bytes_written = 0;
+
+    fwrite(&frame_type, 1, 1, ofp);
+    bytes_written += rle->len * fwrite(rle->data, rle->len, 1, ofp);
+
+    // Indicate the end of RLE content with a 0-count
+    bytes_written += sizeof(count) * fwrite(&count, sizeof(count), 1, ofp);
+    fflush(ofp);
+
+    return bytes_written;
+}
+
+// Send a diff too large for RLE as partial compressed frames, one per slice, starting with the
+// slice closest to first_slice and working outwards (upwards first), skipping slices with
+// no deltas. Once byte_budget is spent or the deadline passes, the remaining slices
+// are rolled back in the shadow, so they will show up again in the next frame's diff.
+// At least one slice is always sent. Which slices were sent is noted in slice_sent.
+// Returns the number of slices sent.
+uint32_t write_progressive(ARRAY_TYPE *cur, ARRAY_TYPE *shadow, uint32_t nelems, uint32_t slice_elems, uint32_t *slice_deltas, uint32_t first_slice, uint32_t byte_budget, uint64_t deadline, uint8_t *slice_sent, int codec, int level, FILE *ofp)
+{
+    uint32_t num_slices = (nelems + slice_elems - 1) / slice_elems;
+    uint32_t num_sent = 0;
+    uint32_t bytes_written = 0;
+
+    memset(slice_sent, 0, num_slices);
+
+    for (uint32_t n = 0; n < 2 * num_slices; n++)
+    {
+        // Alternate above and below the first slice, starting with the first slice itself.
+        int64_t slice = (int64_t)first_slice + ((n % 2) ? -(int64_t)((n + 1) / 2) : (int64_t)(n / 2));
+        if ((slice < 0) || (slice >= num_slices) || (slice_deltas[slice] == 0))
+        {
+            continue;
+        }
+
+        uint32_t start = slice * slice_elems;
+        uint32_t len = (start + slice_elems < nelems ? slice_elems : nelems - start);
+
+        if ((num_sent > 0) && ((bytes_written >= byte_budget) || (time64() >= deadline)))
+        {
+            // Put back what the receiver still has, so it isn't lost from the next diff.
+            for (uint32_t i = start; i < start + len; i++)
+            {
+                shadow[i] ^= cur[i];
+            }
+            continue;
+        }
+
+        bytes_written += write_frame_compressed_partial(codec, level, cur, start * sizeof(ARRAY_TYPE), len * sizeof(ARRAY_TYPE), ofp);
+        slice_sent[slice] = 1;
+        num_sent++;
+    }
+
+    return num_sent;
+}
+
+uint32_t read_frame_rle(FILE *ifp, uint32_t bufsize, ARRAY_TYPE *buf)
+{
+    uint32_t bytes_read = 0;
+    uint32_t buf_cursor = 0;
+
+    uint32_t count;
+    RLE_TYPE value;
+
+    bytes_read += sizeof(count) * fread(&count, sizeof(count), 1, ifp);
+
+    while (count != 0)
+    {
+        bytes_read += sizeof(RLE_TYPE) * fread(&value, sizeof(RLE_TYPE), 1, ifp);
+        for (; (count > 0) && (buf_cursor < (bufsize / sizeof(ARRAY_TYPE))); count--)
+        {
+            buf[buf_cursor++] = value;
+        }
+
+        bytes_read += sizeof(count) * fread(&count, sizeof(count), 1, ifp);
+    }
+
+#ifdef VERBOSE
+    fprintf(stderr, "RLE frame efficiency %f\n", (1.0 * bytes_read) / bufsize);
+#endif
+    return bytes_read;
+}
+
+uint32_t read_frame_compressed(FILE *ifp, int codec, uint32_t bufsize, ARRAY_TYPE *buf, uint32_t *decompressed_size_p)
+{
+    uint32_t bytes_read = 0;
+    uint32_t source_data_size;
+    uint32_t compressed_data_size;
+
+#ifdef VERBOSE
+    uint64_t dt = time64();
+#endif
+
+    bytes_read += sizeof(source_data_size) * fread(
+                                                 &source_data_size, sizeof(source_data_size), 1, ifp);
+    bytes_read += sizeof(compressed_data_size) * fread(
+                                                     &compressed_data_size, sizeof(compressed_data_size), 1, ifp);
+
+    if (CODECS[codec].decompress == NULL)
+    {
+        fprintf(stderr, "Frame compressed with %s, which this build doesn't support\n", CODECS[codec].name);
+        return 0;
+    }
+
+    if (source_data_size > bufsize)
+    {
+        fprintf(stderr, "%s frame of %u bytes is larger than the %u byte frame buffer\n", CODECS[codec].name, source_data_size, bufsize);
+        return 0;
+    }
+
+    char *compressed_data = (char *)malloc(compressed_data_size);
+    bytes_read += compressed_data_size * fread(compressed_data, compressed_data_size, 1, ifp);
+#ifdef VERBOSE
+    dt = time64() - dt;
+    fprintf(stderr, "%s compressed data received in %lu μs\n", CODECS[codec].name, dt);
+    dt = time64();
+#endif
+    int decompressed_data_size = CODECS[codec].decompress(
+        compressed_data, (char *)buf, compressed_data_size, source_data_size);
+    free(compressed_data);
+
+    if (decompressed_data_size < 0)
+    {
+        fprintf(stderr, "%s frame failed to decompress\n", CODECS[codec].name);
+        return 0;
+    }
+    *decompressed_size_p = decompressed_data_size;
+
+#ifdef VERBOSE
+    dt = time64() - dt;
+    fprintf(stderr, "%s decompression of keyframe in %lu μs with ratio %f\n", CODECS[codec].name, dt, (1.0 * compressed_data_size) / decompressed_data_size);
+    fprintf(stderr, "%s frame efficiency %f\n", CODECS[codec].name, (1.0 * bytes_read) / bufsize);
+#endif
+    return bytes_read;
+}
+
+// Read a frame into buf, noting the frame type, and which span of the buffer (in bytes)
+// the frame covers, which is all of it unless it's a partial or tiles frame. Tiles frames
+// also need the current frame, and the tile cache.
+uint32_t read_frame(FILE *ifp, uint32_t bufsize, ARRAY_TYPE *buf, int8_t *frame_type_p, uint32_t *span_offset_p, uint32_t *span_length_p,
+                    ARRAY_TYPE *frame, uint32_t tile_elems, struct tile_slots_s *slots)
+{
+    // Read the header byte
+    int8_t frame_type = -1;
+    if (fread(&frame_type, 1, 1, ifp) == 0)
+    {
+        *frame_type_p = frame_type;
+        return 0;
+    }
+
+#ifdef VERBOSE
+    fprintf(stderr, "Incoming frame type %d\n", frame_type);
+#endif
+    *frame_type_p = frame_type;
+    *span_offset_p = 0;
+    *span_length_p = bufsize;
+
+    // Compressed frames name their codec, and are otherwise handled the same.
+    int codec = (frame_type & FRAME_CODEC_MASK) >> FRAME_CODEC_SHIFT;
+    if (codec >= NUM_CODECS)
+    {
+        fprintf(stderr, "Unknown codec %d in frame header %d\n", codec, frame_type);
+        return 0;
+    }
+
+    switch (frame_type & ~FRAME_CODEC_MASK)
+    {
+    case 0:
+    {
+#ifdef VERBOSE
+        uint64_t dtr = time64();
+#endif
+        uint32_t num_read = fread(buf, bufsize, 1, ifp);
+#ifdef VERBOSE
+        fprintf(stderr, "Took %lu μs to read %lu bytes of keyframe\n", time64() - dtr, num_read * sizeof(ARRAY_TYPE));
+#endif
+        return num_read * sizeof(ARRAY_TYPE);
+    }
+    case 1:
+    {
+#ifdef VERBOSE
+        uint64_t dtr = time64();
+#endif
+        uint32_t num_read = read_frame_rle(ifp, bufsize, buf);
+#ifdef VERBOSE
+        fprintf(stderr, "Took %lu μs to read %u bytes of RLE frame\n", time64() - dtr, num_read);
+#endif
+        return num_read;
+    }
+    case 2:
+    {
+#ifdef VERBOSE
+        uint64_t dtr = time64();
+#endif
+        uint32_t num_read = read_frame_compressed(ifp, codec, bufsize, buf, span_length_p);
+#ifdef VERBOSE
+        fprintf(stderr, "Took %lu μs to read %u bytes of %s frame\n", time64() - dtr, num_read, CODECS[codec].name);
+#endif
+        return num_read;
+    }
+    case FRAME_TYPE_COMPRESSED | FRAME_PARTIAL:
+    {
+#ifdef VERBOSE
+        uint64_t dtr = time64();
+#endif
+        uint32_t offset;
+        if ((fread(&offset, sizeof(offset), 1, ifp) == 0) || (offset >= bufsize) || ((offset % sizeof(ARRAY_TYPE)) != 0))
+        {
+            fprintf(stderr, "Bad partial frame offset\n");
+            return 0;
+        }
+
+        uint32_t num_read = read_frame_compressed(ifp, codec, bufsize - offset, buf + offset / sizeof(ARRAY_TYPE), span_length_p);
+        *span_offset_p = offset;
+#ifdef VERBOSE
+        fprintf(stderr, "Took %lu μs to read %u bytes of partial %s frame at %u\n", time64() - dtr, num_read, CODECS[codec].name, offset);
+#endif
+        return (num_read > 0 ? num_read + sizeof(offset) : 0);
+    }
+    case FRAME_TYPE_TILES:
+    {
+#ifdef VERBOSE
+        uint64_t dtr = time64();
+#endif
+        uint32_t num_read = read_frame_tiles(ifp, bufsize, buf, frame, tile_elems, slots, span_offset_p, span_length_p);
+#ifdef VERBOSE
+        fprintf(stderr, "Took %lu μs to apply %u bytes of tile cache ops\n", time64() - dtr, num_read);
+#endif
+        return num_read;
+    }
+    case FRAME_TYPE_END:
+        // Nothing to apply, but something was read.
+        *span_length_p = 0;
+        return 1;
+    default:
+        fprintf(stderr, "Unknown frame header %d\n", frame_type);
+        return 0;
+    }
+}
+
+// Check rows of this many pixels are made of whole elements, as both sides work on them
+// an element at a time.
+bool check_row_size(uint32_t width)
+{
+    if (((width * BYTES_PER_PIXEL) % sizeof(ARRAY_TYPE)) != 0)
+    {
+        fprintf(stderr, "Row size is not divisible by %d, the number of bytes per chunk, extra bytes aren't supported yet\n", (int)sizeof(ARRAY_TYPE));
+        return false;
+    }
+
+    return true;
+}
+
+// Check a region of interest fits in the framebuffer, filling in the whole framebuffer for a
+// region with no size. Returns 0 if it's usable, or the exit code for why it isn't.
+int check_region(struct region_s *roi, struct geometry_s *geom)
+{
+    // Without a region of interest, the whole framebuffer is captured.
+    if (roi->width == 0)
+    {
+        roi->x = 0;
+        roi->y = 0;
+        roi->width = geom->width;
+        roi->height = geom->height;
+    }
+
+    // Written so that huge offsets can't wrap around.
+    if ((roi->width > geom->width) || (roi->height > geom->height) ||
+        (roi->x > geom->width - roi->width) || (roi->y > geom->height - roi->height))
+    {
+        fprintf(stderr, "Region %ux%u+%u+%u does not fit in the %ux%u framebuffer\n", roi->width, roi->height, roi->x, roi->y, geom->width, geom->height);
+        return 65;
+    }
+
+    if (!check_row_size(roi->width))
+    {
+        return 63;
+    }
+
+    return 0;
+}
+
+// Encode a region of the framebuffer until the input runs out, or the receiver asks for a
+// different region. Returns true if encoding should start over with the new region in roi.
+bool encode_region(int ifd, struct geometry_s *geom, struct region_s *roi, struct governor_s *gov, struct control_s *ctl, FILE *ofp)
+{
+    uint64_t t0 = time64();
+    uint64_t dt = t0;
+    uint32_t num_frames = 0;
+    bool restart = false;
+
+    uint32_t bytes_per_block = roi->width * roi->height * BYTES_PER_PIXEL;
+    uint32_t row_elems = roi->width * BYTES_PER_PIXEL / sizeof(ARRAY_TYPE);
+    uint32_t nelems = row_elems * roi->height;
+
+    // Allocate two buffers, one for the frame the receiver has, and one for this frame.
+    // The diff is computed in place in the buffer for this frame, and the RLE encoding of
+    // it only needs to be big enough for frames small enough to use RLE.
+    // The receiver starts from a blank frame, so the first frame is just a big diff.
+    // This frame is read with the gaps between rows still in, so it has room for them.
+    ARRAY_TYPE *buf_cur = (ARRAY_TYPE *)malloc(region_span_bytes(roi, geom));
+    ARRAY_TYPE *buf_shadow = (ARRAY_TYPE *)calloc(nelems, sizeof(ARRAY_TYPE));
+    struct rle_output_s rle = {.data = (uint8_t *)malloc(RLE_OUTPUT_CAPACITY)};
+
+    // Large diffs are sent a slice at a time, starting at the top of the page until
+    // there's been some activity somewhere else. Deltas are counted per tile, and the
+    // tiles that make up each slice are totalled up when they're needed.
+    uint32_t tile_elems = TILE_ROWS * row_elems;
+    uint32_t num_tiles = (nelems + tile_elems - 1) / tile_elems;
+    uint32_t tiles_per_slice = PROGRESSIVE_SLICE_ROWS / TILE_ROWS;
+    uint32_t slice_elems = tiles_per_slice * tile_elems;
+    uint32_t num_slices = (nelems + slice_elems - 1) / slice_elems;
+    uint32_t *tile_deltas = (uint32_t *)malloc(num_tiles * sizeof(uint32_t));
+    uint64_t *tile_hashes = (uint64_t *)malloc(num_tiles * sizeof(uint64_t));
+    uint32_t *slice_deltas = (uint32_t *)malloc(num_slices * sizeof(uint32_t));
+    uint8_t *slice_sent = (uint8_t *)malloc(num_slices);
+    uint32_t activity_slice = 0;
+
+    struct tile_cache_s *cache = (struct tile_cache_s *)calloc(1, sizeof(struct tile_cache_s));
+    struct tile_op_s *tile_ops = (struct tile_op_s *)malloc(num_tiles * sizeof(struct tile_op_s));
+
+    // The header tells the receiver to start over from a blank frame with an empty cache.
+    write_stream_header(roi->width, roi->height, ofp);
+    uint32_t numread;
+
+    while (true)
+    {
+        control_poll(ctl);
+
+        if (ctl->region_changed)
+        {
+            ctl->region_changed = false;
+            struct region_s region = ctl->region;
+            if (check_region(&region, geom) == 0)
+            {
+                fprintf(stderr, "Changing region to %ux%u+%u+%u\n", region.width, region.height, region.x, region.y);
+                *roi = region;
+                restart = true;
+                break;
+            }
+        }
+
+        // A keyframe is just starting over, everything is sent again as one big diff.
+        if (ctl->keyframe)
+        {
+            ctl->keyframe = false;
+            memset(buf_shadow, 0, bytes_per_block);
+            memset(cache, 0, sizeof(struct tile_cache_s));
+            write_stream_header(roi->width, roi->height, ofp);
+            fprintf(stderr, "Sending a keyframe\n");
+        }
+
+        uint32_t level = governor_update(gov);
+        float frametime = FRAMETIME_TARGET * (1 + level);
+        LZ4_ACCELERATION = 1 << (2 * level);
+        int codec = (level > 0 ? CODEC_LZ4 : COMPRESSION_CODEC);
+        int codec_level = (level > 0 ? 0 : COMPRESSION_LEVEL);
+
+        dt = time64();
+        if ((num_frames % 30) == 0)
+        {
+            fprintf(stderr, "%f\n", 1000000.0 * num_frames / (dt - t0));
+            num_frames = 1;
+            t0 = dt;
+        }
+
+        // Read the new frame, the last frame is in buf_shadow
+        numread = read_region(ifd, roi, geom, buf_cur);
+
+        if (numread != bytes_per_block)
+        {
+            break;
+        }
+
+        // A file of captured frames is played through a frame at a time, and runs out at
+        // the end, whereas a framebuffer is read from the same place every time.
+        geom->offset += geom->frame_bytes;
+
+        // Diff, update the shadow, and RLE encode all at once.
+        uint32_t num_deltas = diff_and_encode(buf_cur, buf_shadow, row_elems, roi->height, tile_deltas, &rle);
+
 #ifdef VERBOSE
-        fprintf(stderr, "Took %lu μs to diff frames with %lu deltas\n", time64() - dt, num_deltas);
+        fprintf(stderr, "Took %lu μs to diff frames with %u deltas\n", time64() - dt, num_deltas);
 #endif
 
         if (num_deltas < MAX_DELTAS_FOR_RLE)
         {
             uint64_t dt = time64();
-            write_frame_rle(buf_diff, bytes_per_block, ofp);
+            write_frame_rle_output(&rle, ofp);
             dt = time64() - dt;
 #ifdef VERBOSE
             fprintf(stderr, "Wrote RLE frame in %lu μs\n", dt);
 #endif
+
+            // Small changes are where the pen is, so that's where large changes start.
+            if (num_deltas > 0)
+            {
+                uint32_t activity_tile = 0;
+                for (uint32_t tile = 1; tile < num_tiles; tile++)
+                {
+                    if (tile_deltas[tile] > tile_deltas[activity_tile])
+                    {
+                        activity_tile = tile;
+                    }
+                }
+                activity_slice = activity_tile / tiles_per_slice;
+            }
         }
         else
         {
+            uint64_t frame_start = dt;
             uint64_t dt = time64();
-            write_frame_lz4(buf_diff, bytes_per_block, ofp);
+
+            // Anything the receiver has cached can be loaded straight away.
+            uint32_t num_loaded = tile_cache_match(cache, buf_shadow, buf_cur, nelems, tile_elems, tile_deltas, tile_hashes, tile_ops);
+            if (num_loaded > 0)
+            {
+                write_frame_tiles(tile_ops, num_loaded, ofp);
+            }
+
+            for (uint32_t slice = 0; slice < num_slices; slice++)
+            {
+                slice_deltas[slice] = 0;
+                for (uint32_t tile = slice * tiles_per_slice; (tile < (slice + 1) * tiles_per_slice) && (tile < num_tiles); tile++)
+                {
+                    slice_deltas[slice] += tile_deltas[tile];
+                }
+            }
+
+            uint32_t num_sent = write_progressive(buf_cur, buf_shadow, nelems, slice_elems, slice_deltas, activity_slice,
+                                                  PROGRESSIVE_BYTE_BUDGET >> level,
+                                                  frame_start + (uint64_t)(1000000 * frametime * PROGRESSIVE_TIME_BUDGET),
+                                                  slice_sent, codec, codec_level, ofp);
+
+            // And whatever was sent can be cached for next time.
+            uint32_t num_stored = tile_cache_store(cache, num_tiles, tile_deltas, tile_hashes, slice_sent, tile_ops);
+            if (num_stored > 0)
+            {
+                write_frame_tiles(tile_ops, num_stored, ofp);
+            }
+            write_frame_end(ofp);
+
             dt = time64() - dt;
-            fprintf(stderr, "Writing full frame, skipping RLE due to delta count, in %lu μs\n", dt);
+            fprintf(stderr, "Writing progressive frame, skipping RLE due to delta count, %u slices and %u cached tiles in %lu μs\n", num_sent, num_loaded, dt);
         }
         num_frames++;
-        SWAP(buf_a, buf_b, buf_tmp);
 
         // Calculate the final time to output the frame
         dt = time64() - dt;
@@ -443,58 +1549,340 @@ void encode(uint32_t bytes_per_block)
         fprintf(stderr, "Took %lu μs to output a frame\n", dt);
 #endif
 
-        if (((1000000 * FRAMETIME_TARGET) - dt) > 0)
+        if (((1000000 * frametime) - dt) > 0)
+        {
+            usleep((1000000 * frametime) - dt);
+        }
+    }
+
+    free(tile_ops);
+    free(cache);
+    free(slice_sent);
+    free(slice_deltas);
+    free(tile_hashes);
+    free(tile_deltas);
+    free(rle.data);
+    free(buf_shadow);
+    free(buf_cur);
+
+    return restart;
+}
+
+void encode(const char *input_path, struct region_s *roi, float cpu_budget, const char *control_path)
+{
+    int ifd = open(input_path, O_RDONLY);
+    FILE *ofp = stdout;
+    struct geometry_s geom;
+
+    if (ifd < 0)
+    {
+        fprintf(stderr, "Unable to open framebuffer %s\n", input_path);
+        exit(64);
+    }
+
+    if (!read_geometry(ifd, &geom))
+    {
+        fprintf(stderr, "%s is not a framebuffer, and doesn't start with a header\n", input_path);
+        exit(67);
+    }
+
+    if (geom.bits_per_pixel != PIXEL_BITS)
+    {
+        fprintf(stderr, "Framebuffer has %u bits per pixel, but this build is for %d\n", geom.bits_per_pixel, PIXEL_BITS);
+        exit(68);
+    }
+
+    fprintf(stderr, "Capturing %ux%u at %u bits per pixel, with rows %u bytes apart\n", geom.width, geom.height, geom.bits_per_pixel, geom.stride);
+
+    int err = check_region(roi, &geom);
+    if (err != 0)
+    {
+        exit(err);
+    }
+
+    // Commands come from stdin, or a named pipe. The pipe is opened for writing as well, so
+    // it never reaches end of file when one writer goes away and another comes along later.
+    struct control_s ctl;
+    control_init(&ctl, -1);
+    if (control_path != NULL)
+    {
+        ctl.fd = (strcmp(control_path, "-") == 0 ? 0 : open(control_path, O_RDWR));
+        if (ctl.fd < 0)
+        {
+            fprintf(stderr, "Unable to open control channel %s\n", control_path);
+            exit(66);
+        }
+    }
+
+    // The governor decides how hard each frame can work, based on how hard the last ones did.
+    struct governor_s gov;
+    governor_init(&gov, cpu_budget);
+
+    while (encode_region(ifd, &geom, roi, &gov, &ctl, ofp))
+    {
+    }
+
+    close(ifd);
+}
+
+// A small scratch buffer for assembling NUT packets before they are checksummed and
+// written out. None of the NUT packets we emit come close to this size.
+struct nut_packet_s
+{
+    uint8_t data[256];
+    uint32_t len;
+};
+
+void nut_put_v(struct nut_packet_s *p, uint64_t val)
+{
+    // NUT variable length integers are big-endian 7-bit groups, with the high bit set on
+    // every byte except the last.
+    int num_groups = 1;
+    while ((num_groups < 10) && ((val >> (7 * num_groups)) != 0))
+    {
+        num_groups++;
+    }
+
+    for (int g = num_groups - 1; g >= 0; g--)
+    {
+        p->data[p->len++] = ((val >> (7 * g)) & 0x7f) | (g > 0 ? 0x80 : 0);
+    }
+}
+
+void nut_put_u32(struct nut_packet_s *p, uint32_t val)
+{
+    for (int b = 3; b >= 0; b--)
+    {
+        p->data[p->len++] = (val >> (8 * b)) & 0xff;
+    }
+}
+
+// CRC32 as used by NUT (and Ogg): generator 0x04C11DB7, MSB first, starting value zero.
+uint32_t nut_crc32(const uint8_t *data, uint32_t len)
+{
+    uint32_t crc = 0;
+
+    for (uint32_t i = 0; i < len; i++)
+    {
+        crc ^= (uint32_t)data[i] << 24;
+        for (int b = 0; b < 8; b++)
         {
-            usleep((1000000 * FRAMETIME_TARGET) - dt);
+            crc = (crc & 0x80000000) ? ((crc << 1) ^ 0x04C11DB7) : (crc << 1);
         }
     }
 
-    fclose(ifp);
+    return crc;
+}
+
+// Write a startcode-delimited packet (main header, stream header, syncpoint), which is
+// the startcode, a forward pointer, the payload, and a checksum of the payload.
+uint32_t nut_write_packet(uint64_t startcode, struct nut_packet_s *payload, FILE *ofp)
+{
+    struct nut_packet_s header = {.len = 0};
+
+    nut_put_u32(&header, startcode >> 32);
+    nut_put_u32(&header, startcode & 0xffffffff);
+    // The forward pointer covers the payload and the trailing checksum.
+    nut_put_v(&header, payload->len + 4);
+
+    // Large packets also carry a checksum of the packet header itself.
+    if ((payload->len + 4) > 4096)
+    {
+        nut_put_u32(&header, nut_crc32(header.data, header.len));
+    }
+
+    uint32_t checksum = nut_crc32(payload->data, payload->len);
+    nut_put_u32(payload, checksum);
+
+    uint32_t bytes_written = 0;
+    bytes_written += header.len * fwrite(header.data, header.len, 1, ofp);
+    bytes_written += payload->len * fwrite(payload->data, payload->len, 1, ofp);
+
+    return bytes_written;
+}
+
+// Write the NUT file header: the file ID string, the main header with a single
+// frame code, and a stream header describing one rawvideo RGB565 stream timestamped in
+// microseconds.
+uint32_t nut_write_header(uint32_t width, uint32_t height, FILE *ofp)
+{
+    uint32_t bytes_written = 0;
+    struct nut_packet_s p;
+
+    bytes_written += sizeof(NUT_FILE_ID) * fwrite(NUT_FILE_ID, sizeof(NUT_FILE_ID), 1, ofp);
+
+    p.len = 0;
+    nut_put_v(&p, 3);                 // version
+    nut_put_v(&p, 1);                 // stream_count
+    nut_put_v(&p, NUT_MAX_DISTANCE);  // max_distance
+    nut_put_v(&p, 1);                 // time_base_count
+    nut_put_v(&p, 1);                 // time_base_num
+    nut_put_v(&p, 1000000);           // time_base_denom, timestamps are in μs
+    // Frame codes: every code (other than 'N', which is implicitly invalid) describes a
+    // keyframe on stream 0 with an explicit timestamp, size, and header checksum.
+    nut_put_v(&p, NUT_FRAME_FLAGS);   // tmp_flags
+    nut_put_v(&p, 6);                 // tmp_fields
+    nut_put_v(&p, 0);                 // tmp_pts (signed, 0)
+    nut_put_v(&p, 1);                 // tmp_mul
+    nut_put_v(&p, 0);                 // tmp_stream
+    nut_put_v(&p, 0);                 // tmp_size
+    nut_put_v(&p, 0);                 // tmp_res
+    nut_put_v(&p, 255);               // count
+    nut_put_v(&p, 0);                 // header_count_minus1
+    bytes_written += nut_write_packet(NUT_MAIN_STARTCODE, &p, ofp);
+
+    p.len = 0;
+    nut_put_v(&p, 0);                 // stream_id
+    nut_put_v(&p, 0);                 // stream_class, video
+    nut_put_v(&p, 4);                 // fourcc length
+    memcpy(p.data + p.len, NUT_FOURCC, 4);
+    p.len += 4;
+    nut_put_v(&p, 0);                 // time_base_id
+    nut_put_v(&p, NUT_MSB_PTS_SHIFT); // msb_pts_shift
+    nut_put_v(&p, 1000000);           // max_pts_distance
+    nut_put_v(&p, 0);                 // decode_delay
+    nut_put_v(&p, 0);                 // stream_flags
+    nut_put_v(&p, 0);                 // codec_specific_data length
+    nut_put_v(&p, width);             // width
+    nut_put_v(&p, height);            // height
+    nut_put_v(&p, 0);                 // sample_width
+    nut_put_v(&p, 0);                 // sample_height
+    nut_put_v(&p, 0);                 // colorspace_type
+    bytes_written += nut_write_packet(NUT_STREAM_STARTCODE, &p, ofp);
+
+    fflush(ofp);
+    return bytes_written;
+}
+
+// Write a single video frame with the given timestamp, in μs. Every frame is preceded by
+// a syncpoint so that frames are never further than max_distance from one, as each frame
+// is much larger than that.
+uint32_t nut_write_frame(ARRAY_TYPE *buf, uint32_t bufsize, uint64_t pts, FILE *ofp)
+{
+    uint32_t bytes_written = 0;
+    struct nut_packet_s p;
+
+    p.len = 0;
+    nut_put_v(&p, pts); // global_key_pts, with only one time base
+    nut_put_v(&p, 0);   // back_ptr_div16, every frame is a keyframe so it is this syncpoint
+    bytes_written += nut_write_packet(NUT_SYNCPOINT_STARTCODE, &p, ofp);
+
+    p.len = 0;
+    p.data[p.len++] = 0;                         // frame_code
+    nut_put_v(&p, pts + (1 << NUT_MSB_PTS_SHIFT)); // coded_pts, as a full timestamp
+    nut_put_v(&p, bufsize);                      // data_size_msb, with a multiplier of 1
+    nut_put_u32(&p, nut_crc32(p.data, p.len));
+    bytes_written += p.len * fwrite(p.data, p.len, 1, ofp);
+
+    bytes_written += bufsize * fwrite(buf, bufsize, 1, ofp);
+    fflush(ofp);
+
+    return bytes_written;
+}
+
+// Write a decoded frame in the requested output format, returning the number of
+// ARRAY_TYPE blocks of pixel data written.
+uint32_t write_output_frame(ARRAY_TYPE *buf, uint32_t bufsize, int output_format, uint64_t pts, FILE *ofp)
+{
+    switch (output_format)
+    {
+    case OUTPUT_NUT:
+        nut_write_frame(buf, bufsize, pts, ofp);
+        return bufsize / sizeof(ARRAY_TYPE);
+    case OUTPUT_RAW:
+    default:
+        return fwrite(buf, sizeof(ARRAY_TYPE), bufsize / sizeof(ARRAY_TYPE), ofp);
+    }
+}
+
+// Empty the receiver's tile cache, for when the encoder starts over.
+void tile_slots_clear(struct tile_slots_s *slots)
+{
+    for (uint32_t slot = 0; slot < TILE_CACHE_SLOTS; slot++)
+    {
+        free(slots->data[slot]);
+    }
+    memset(slots, 0, sizeof(struct tile_slots_s));
+}
+
+// Ask the encoder to start over, if there's a control channel to ask it on.
+void request_keyframe(int control_fd)
+{
+    if (control_fd < 0)
+    {
+        fprintf(stderr, "Waiting for the encoder to start over\n");
+        return;
+    }
+
+    fprintf(stderr, "Asking the encoder for a keyframe\n");
+    if (write(control_fd, "k\n", 2) != 2)
+    {
+        fprintf(stderr, "Unable to request a keyframe\n");
+    }
 }
 
-void decode(uint32_t bytes_per_block)
+void decode(int output_format, const char *control_path)
 {
     FILE *ifp = stdin;
     FILE *ofp = stdout;
     uint64_t dt = time64();
     uint64_t last_stats_time = dt;
-
-    //TODO: Handle when bytes_per_block is not a multiple of sizeof(ARRAY_TYPE)
-    if ((bytes_per_block % sizeof(ARRAY_TYPE)) != 0)
+    uint32_t width = 0, height = 0;
+    uint32_t bytes_per_block = 0;
+    uint32_t row_elems = 0;
+
+    // Commands go back to the encoder over the control channel, which is held open so that
+    // other commands, such as pausing, can be written to it alongside ours. It's opened
+    // before reading anything, as the encoder's input may be waiting on it being opened.
+    int control_fd = -1;
+    if (control_path != NULL)
     {
-        fprintf(stderr, "Input block size is not divisible by %d, the number of bytes per chunk, extra bytes aren't supported yet\n", (int)sizeof(ARRAY_TYPE));
-        exit(62);
+        control_fd = open(control_path, O_WRONLY);
+        if (control_fd < 0)
+        {
+            fprintf(stderr, "Unable to open control channel %s\n", control_path);
+            exit(66);
+        }
     }
 
-    // Allocate two buffers, one for the last frame, and one for this frame.
-    ARRAY_TYPE *buf = (ARRAY_TYPE *)malloc(bytes_per_block);
-    ARRAY_TYPE *diff = (ARRAY_TYPE *)malloc(bytes_per_block);
-
-    // Allocate one more buffer as the output buffer that gets written to stdout
-    // This is different from the current frame from the tablet, as it contains mangled
-    // pixels that have been colourmap()-ed.
-    ARRAY_TYPE *obuf = (ARRAY_TYPE *)malloc(bytes_per_block);
+    // The buffers are allocated once the stream header says how big frames are.
+    // Two buffers, one for the last frame, and one for this frame, and one more as the
+    // output buffer that gets written to stdout. This is different from the current frame
+    // from the tablet, as it contains mangled pixels that have been colourmap()-ed.
+    ARRAY_TYPE *buf = NULL;
+    ARRAY_TYPE *diff = NULL;
+    ARRAY_TYPE *obuf = NULL;
 
     uint32_t num_frames = 0;
     uint64_t bytes_read = 0;
     uint32_t num_keyframes = 0;
     int8_t frame_type = -1;
+    uint32_t span_offset, span_length;
 
-    // Prime the pump;
-    uint32_t numread = read_frame(ifp, bytes_per_block, buf, &frame_type);
-    num_keyframes++;
-    bytes_read += numread;
+    // Tiles the encoder has asked us to cache, which it may ask us to load later.
+    uint32_t tile_elems = 0;
+    struct tile_slots_s *slots = (struct tile_slots_s *)calloc(1, sizeof(struct tile_slots_s));
 
-    colourmap(buf, obuf, bytes_per_block / sizeof(ARRAY_TYPE));
+    uint32_t num_duplicates = 0;
+    uint32_t interval_changed_rows = 0;
 
-    // Raw write of the framebuffer to stdout.
-    uint32_t blocks_out = fwrite(buf, sizeof(ARRAY_TYPE), bytes_per_block / sizeof(ARRAY_TYPE), ofp);
+    // Until there's been a header, or after losing data, nothing can be decoded, and the
+    // input is skipped up to the next header. The encoder is asked to start over, and asked
+    // again every so often in case the request or its answer went missing.
+    bool synced = false;
+    uint8_t window[STREAM_HEADER_SIZE];
+    uint32_t window_len = 0;
+    uint64_t bytes_skipped = 0;
+    uint64_t last_request = 0;
 
-    num_frames++;
+    // Timestamps in the NUT output are relative to when the first frame arrived.
+    uint64_t pts_origin = dt;
+
+    uint32_t numread;
+    uint32_t blocks_out;
 
 #ifdef VERBOSE
-    fprintf(stderr, "Wrote %u blocks of rawvideo frame\n", blocks_out);
-    fprintf(stderr, "Finished setting up decoder in %lu μs\n", dt);
+    fprintf(stderr, "Finished setting up decoder in %lu μs\n", time64() - dt);
 #endif
 
     while (true)
@@ -503,50 +1891,239 @@ void decode(uint32_t bytes_per_block)
 
         if ((dt2 - last_stats_time) > (STATS_INTERVAL * 1000000))
         {
-            fprintf(stderr, "Total frames: %u, Avg framerate: %f, Key frames: %u, Bytes read: %lu, Avg framesize: %f\n", num_frames, (1000000.0 * num_frames) / (dt2 - last_stats_time), num_keyframes, bytes_read, 1.0 * bytes_read / num_frames);
+            fprintf(stderr, "Total frames: %u, Avg framerate: %f, Key frames: %u, Duplicate frames: %u, Bytes read: %lu, Avg framesize: %f\n", num_frames, (1000000.0 * num_frames) / (dt2 - last_stats_time), num_keyframes, num_duplicates, bytes_read, 1.0 * bytes_read / num_frames);
 
             last_stats_time = dt2;
             bytes_read = 0;
             num_frames = 0;
             num_keyframes = 0;
+            num_duplicates = 0;
+        }
+
+        // A header means the encoder has started over from a blank frame, possibly with
+        // a different region.
+        bool got_header = false;
+        uint32_t new_width, new_height, bits_per_pixel;
+
+        if (!synced)
+        {
+            // Slide along the input a byte at a time until there's a header in the window, so
+            // a stray header byte can't swallow the start of a real header.
+            while (window_len < STREAM_HEADER_SIZE)
+            {
+                int next_byte = fgetc(ifp);
+                if (next_byte == EOF)
+                {
+                    break;
+                }
+                window[window_len++] = next_byte;
+            }
+
+            if (window_len < STREAM_HEADER_SIZE)
+            {
+                break;
+            }
+
+            if (!parse_stream_header(window, &new_width, &new_height, &bits_per_pixel))
+            {
+                if (last_request == 0)
+                {
+                    fprintf(stderr, "Skipping input until the next stream header\n");
+                    request_keyframe(control_fd);
+                    last_request = dt2;
+                }
+                else if ((control_fd >= 0) && ((dt2 - last_request) > (RESYNC_TIMEOUT * 1000000)))
+                {
+                    request_keyframe(control_fd);
+                    last_request = dt2;
+                }
+
+                memmove(window, window + 1, --window_len);
+                bytes_skipped++;
+                continue;
+            }
+
+            window_len = 0;
+            got_header = true;
+        }
+        else
+        {
+            int next_type = fgetc(ifp);
+            if (next_type == EOF)
+            {
+                break;
+            }
+
+            if (next_type == FRAME_TYPE_HEADER)
+            {
+                window[0] = next_type;
+                window_len = 1 + fread(window + 1, 1, STREAM_HEADER_SIZE - 1, ifp);
+                if (window_len < STREAM_HEADER_SIZE)
+                {
+                    break;
+                }
+
+                // Anything else starting with a header byte means the stream has lost its
+                // place, and the window is where to start looking for the next header.
+                if (!parse_stream_header(window, &new_width, &new_height, &bits_per_pixel))
+                {
+                    fprintf(stderr, "Bad stream header\n");
+                    synced = false;
+                    last_request = 0;
+                    continue;
+                }
+
+                window_len = 0;
+                got_header = true;
+            }
+            else
+            {
+                ungetc(next_type, ifp);
+            }
+        }
+
+        if (got_header)
+        {
+            // A stream we can't decode is never going to work.
+            if (bits_per_pixel != PIXEL_BITS)
+            {
+                fprintf(stderr, "Stream has %u bits per pixel, only %d are supported\n", bits_per_pixel, PIXEL_BITS);
+                exit(61);
+            }
+            if (!check_row_size(new_width))
+            {
+                exit(61);
+            }
+
+            uint32_t old_width = width, old_height = height;
+            uint32_t stream_bytes = new_width * new_height * BYTES_PER_PIXEL;
+            width = new_width;
+            height = new_height;
+
+            if (bytes_skipped > 0)
+            {
+                fprintf(stderr, "Skipped %lu bytes to get to a header\n", bytes_skipped);
+                bytes_skipped = 0;
+            }
+
+            if ((width != old_width) || (height != old_height))
+            {
+                // NUT streams can't change size part way through.
+                if ((output_format == OUTPUT_NUT) && (old_width != 0))
+                {
+                    fprintf(stderr, "Stream frames are now %ux%u instead of %ux%u, which a NUT stream can't change to, so stopping\n", width, height, old_width, old_height);
+                    fflush(ofp);
+                    exit(69);
+                }
+
+                if (old_width != 0)
+                {
+                    fprintf(stderr, "Stream frames are now %ux%u, whatever reads the output will need restarting\n", width, height);
+                }
+                else
+                {
+                    fprintf(stderr, "Stream frames are %ux%u\n", width, height);
+                }
+
+                if (output_format == OUTPUT_NUT)
+                {
+                    nut_write_header(width, height, ofp);
+                }
+            }
+
+            if (stream_bytes != bytes_per_block)
+            {
+                bytes_per_block = stream_bytes;
+                buf = (ARRAY_TYPE *)realloc(buf, bytes_per_block);
+                diff = (ARRAY_TYPE *)realloc(diff, bytes_per_block);
+                obuf = (ARRAY_TYPE *)realloc(obuf, bytes_per_block);
+            }
+            row_elems = width * BYTES_PER_PIXEL / sizeof(ARRAY_TYPE);
+            tile_elems = TILE_ROWS * row_elems;
+
+            // The encoder starts from a blank frame, so everything after a header makes up a
+            // keyframe, however many frames it's sent in.
+            num_keyframes++;
+            memset(buf, 0, bytes_per_block);
+            memset(obuf, 0, bytes_per_block);
+            tile_slots_clear(slots);
+            interval_changed_rows = 0;
+            synced = true;
+            last_request = 0;
+            continue;
         }
 
         // Read the new frame, the last frame is in bufB
-        numread = read_frame(ifp, bytes_per_block, diff, &frame_type);
+        numread = read_frame(ifp, bytes_per_block, diff, &frame_type, &span_offset, &span_length, buf, tile_elems, slots);
 #ifdef VERBOSE
         fprintf(stderr, "Took %lu μs to read diff\n", time64() - dt2);
 #endif
         if (numread == 0)
         {
-            break;
-        }
+            if (feof(ifp))
+            {
+                break;
+            }
 
-        if ((frame_type == FRAME_TYPE_FULL) || (frame_type == FRAME_TYPE_LZ4))
-        {
-            num_keyframes++;
+            // The rest of this frame can't be found, so skip to the encoder starting over.
+            synced = false;
+            window_len = 0;
+            last_request = 0;
+            interval_changed_rows = 0;
+            continue;
         }
 
         bytes_read += numread;
 
         dt2 = time64();
-        // Now run through and fwrite each element
-        for (uint32_t i = 0; i < bytes_per_block / sizeof(ARRAY_TYPE); i++)
+        // Now run through the span the frame covers a row at a time, applying the diff, and
+        // colouring only the rows that changed.
+        uint32_t span_start = span_offset / sizeof(ARRAY_TYPE);
+        uint32_t span_end = span_start + span_length / sizeof(ARRAY_TYPE);
+        uint32_t num_changed_rows = 0;
+        uint32_t num_mapped_colours = 0;
+        for (uint32_t row_start = span_start - (span_start % row_elems); row_start < span_end; row_start += row_elems)
         {
-            buf[i] ^= diff[i];
+            uint32_t start = (row_start > span_start ? row_start : span_start);
+            uint32_t end = (row_start + row_elems < span_end ? row_start + row_elems : span_end);
+            ARRAY_TYPE changed = 0;
+            for (uint32_t i = start; i < end; i++)
+            {
+                buf[i] ^= diff[i];
+                changed |= diff[i];
+            }
+
+            if (changed != 0)
+            {
+                num_mapped_colours += colourmap(buf + start, obuf + start, end - start);
+                num_changed_rows++;
+            }
         }
 #ifdef VERBOSE
-        fprintf(stderr, "Took %lu μs to apply diff\n", time64() - dt2);
+        fprintf(stderr, "Took %lu μs to apply diff to %u rows, colouring %u pixels\n", time64() - dt2, num_changed_rows, num_mapped_colours);
 #endif
+        interval_changed_rows += num_changed_rows;
 
-        dt2 = time64();
-        uint32_t num_mapped_colours = colourmap(buf, obuf, bytes_per_block / sizeof(ARRAY_TYPE));
-#ifdef VERBOSE
-        fprintf(stderr, "Took %lu μs to colour %u pixels\n", time64() - dt2, num_mapped_colours);
-#endif
+        // Large changes arrive as partial and tiles frames, which only add up to a frame of
+        // output once the encoder marks the end of the interval.
+        if (((frame_type & FRAME_PARTIAL) != 0) || (frame_type == FRAME_TYPE_TILES))
+        {
+            continue;
+        }
+        num_frames++;
+
+        // Timestamped output formats don't need a frame for every interval, so an empty
+        // interval doesn't need to be written at all.
+        bool interval_changed = (interval_changed_rows > 0);
+        interval_changed_rows = 0;
+        if (!interval_changed && (output_format != OUTPUT_RAW))
+        {
+            num_duplicates++;
+            continue;
+        }
 
         dt2 = time64();
-        blocks_out = fwrite(obuf, sizeof(ARRAY_TYPE), bytes_per_block / sizeof(ARRAY_TYPE), ofp);
-        num_frames++;
+        blocks_out = write_output_frame(obuf, bytes_per_block, output_format, dt2 - pts_origin, ofp);
 
 #ifdef VERBOSE
         fprintf(stderr, "Wrote %u blocks of rawvideo frame\n", blocks_out);
@@ -555,63 +2132,178 @@ void decode(uint32_t bytes_per_block)
     }
 }
 
-// int main_lz4_test(int argc, char **argv)
-// {
-//     char mode = argv[1][0];
+void usage()
+{
+    fprintf(stderr, "Program usage: blockdiff [-r WxH+X+Y] [-c cpu%%] [-z codec[:level]] [-D dictionary] [-C control] [-i input] <e|d|n> [target fps, default=5]\n");
+    fprintf(stderr, "    e: Encode the framebuffer to stdout\n");
+    fprintf(stderr, "    d: Decode stdin to raw video frames at the incoming rate\n");
+    fprintf(stderr, "    n: Decode stdin to a variable framerate NUT stream, skipping unchanged frames\n");
+    fprintf(stderr, "    -r: Only encode the given region of the framebuffer, in pixels\n");
+    fprintf(stderr, "    -c: Throttle the encoder to stay under this percentage of a CPU\n");
+    fprintf(stderr, "    -z: Compress large changes with lz4 (default), lz4hc, or zstd, at the given level\n");
+    fprintf(stderr, "    -D: Load a zstd dictionary, which must be given to both the encoder and decoder\n");
+    fprintf(stderr, "    -C: Control channel, which the encoder reads commands from (- for stdin) and the decoder writes them to\n");
+    fprintf(stderr, "    -i: Encode this framebuffer, or file of frames starting with a stream header, instead of %s\n", DEFAULT_INPUT);
+}
+
+// Parse a codec[:level] compression option into COMPRESSION_CODEC and COMPRESSION_LEVEL.
+void parse_codec(const char *arg)
+{
+    char name[16];
+    int level = 0;
+    int num_parsed = sscanf(arg, "%15[^:]:%d", name, &level);
+
+    if (num_parsed < 1)
+    {
+        fprintf(stderr, "Unable to parse compression, expected codec[:level]\n");
+        exit(7);
+    }
+
+    if (strcmp(name, "lz4") == 0)
+    {
+        // Plain LZ4 has no levels, that's what lz4hc is for.
+        if (num_parsed > 1)
+        {
+            fprintf(stderr, "lz4 doesn't take a level, use lz4hc:%d for a compression level\n", level);
+            exit(7);
+        }
+        COMPRESSION_CODEC = CODEC_LZ4;
+        COMPRESSION_LEVEL = 0;
+    }
+    else if (strcmp(name, "lz4hc") == 0)
+    {
+        COMPRESSION_CODEC = CODEC_LZ4;
+        COMPRESSION_LEVEL = (num_parsed > 1 && level > 0 ? level : LZ4HC_CLEVEL_DEFAULT);
+    }
+    else if (strcmp(name, "zstd") == 0)
+    {
+        COMPRESSION_CODEC = CODEC_ZSTD;
+        COMPRESSION_LEVEL = (num_parsed > 1 ? level : 3);
+    }
+    else
+    {
+        fprintf(stderr, "Unknown compression codec %s\n", name);
+        exit(7);
+    }
+
+    if (CODECS[COMPRESSION_CODEC].compress == NULL)
+    {
+        fprintf(stderr, "This build doesn't support %s compression\n", CODECS[COMPRESSION_CODEC].name);
+        exit(7);
+    }
+}
+
+// Read a whole dictionary file into COMPRESSION_DICT.
+void load_dictionary(const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Unable to open dictionary %s\n", path);
+        exit(8);
+    }
+
+    long dict_size = -1;
+    if (fseek(fp, 0, SEEK_END) == 0)
+    {
+        dict_size = ftell(fp);
+    }
+
+    if ((dict_size <= 0) || (fseek(fp, 0, SEEK_SET) != 0))
+    {
+        fprintf(stderr, "Dictionary %s is empty, or isn't a regular file\n", path);
+        exit(8);
+    }
+    COMPRESSION_DICT_SIZE = dict_size;
+
+    COMPRESSION_DICT = (char *)malloc(COMPRESSION_DICT_SIZE);
+    if (fread(COMPRESSION_DICT, COMPRESSION_DICT_SIZE, 1, fp) == 0)
+    {
+        fprintf(stderr, "Unable to read dictionary %s\n", path);
+        exit(8);
+    }
 
-//     if (mode == 'e')
-//     {
-//         const char* const src = "Lorem ipsum dolor sit amet, consectetur adipiscing elit. Lorem ipsum dolor site amat";
-//         ARRAY_TYPE* buf = (ARRAY_TYPE*) src;
-//         uint32_t bufsize = strlen(src) / sizeof(ARRAY_TYPE);
-//         write_frame_lz4(buf, bufsize, stdout);
-//     }
-//     else
-//     {
-//         char* src = (char*)malloc(4096);
-//         int8_t frame_type;
-//         fread(&frame_type, 1, 1, stdin);
-//         read_frame_lz4(stdin, 4096/ sizeof(ARRAY_TYPE), (ARRAY_TYPE*)src);
-//         printf("%s\n", src);
-//     }
-//     return 0;
-// }
+    fclose(fp);
+}
 
 int main(int argc, char **argv)
 {
-    if (argc < 3)
+    struct region_s roi = {0, 0, 0, 0};
+    float cpu_budget = 0;
+    const char *control_path = NULL;
+    const char *input_path = DEFAULT_INPUT;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:c:z:D:C:i:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'r':
+            if (!parse_region(optarg, &roi))
+            {
+                fprintf(stderr, "Unable to parse region of interest, expected WxH+X+Y\n");
+                exit(5);
+            }
+            break;
+        case 'c':
+            if ((sscanf(optarg, "%f", &cpu_budget) == 0) || (cpu_budget <= 0) || (cpu_budget > 100))
+            {
+                fprintf(stderr, "Unable to parse CPU budget, expected a percentage\n");
+                exit(6);
+            }
+            cpu_budget /= 100;
+            break;
+        case 'z':
+            parse_codec(optarg);
+            break;
+        case 'D':
+            load_dictionary(optarg);
+            break;
+        case 'C':
+            control_path = optarg;
+            break;
+        case 'i':
+            input_path = optarg;
+            break;
+        default:
+            usage();
+            exit(1);
+        }
+    }
+
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    if (argc < 2)
     {
-        fprintf(stderr, "Program usage: blockdiff <e|d> <bytes> [target fps, default=5]\n");
+        usage();
         exit(1);
     }
 
     char mode = argv[1][0];
-    uint32_t bytes_per_block;
 
-    if (sscanf(argv[2], "%u", &bytes_per_block) == 0)
+    // The frame size used to be given before the framerate, but it comes from the
+    // framebuffer now. Nobody wants more than MAX_TARGET_FPS, so a bigger whole number on
+    // its own is an old frame size too.
+    uint32_t old_bytes;
+    char trailing;
+    if ((argc > 3) || ((argc > 2) && (sscanf(argv[2], "%u%c", &old_bytes, &trailing) == 1) && (old_bytes > MAX_TARGET_FPS)))
     {
-        fprintf(stderr, "Unable to parse number of bytes per block\n");
-        exit(2);
+        fprintf(stderr, "Frame sizes are detected now, ignoring %s\n", argv[2]);
+        argc--;
+        argv++;
     }
 
-    if (argc > 3)
+    if (argc > 2)
     {
         float target_fps;
-        if (sscanf(argv[3], "%f", &target_fps) == 0)
+        if (sscanf(argv[2], "%f", &target_fps) == 0)
         {
             fprintf(stderr, "Unable to parse target framerate as float\n");
             exit(3);
         }
 
-        if (target_fps < 0.1)
-        {
-            fprintf(stderr, "For sanity, setting the target framerate to 0.2fps\n");
-            FRAMETIME_TARGET = 5.0;
-        }
-        else
-        {
-            FRAMETIME_TARGET = (target_fps > 0 ? 1 / target_fps : -1 / target_fps);
-        }
+        set_target_fps(target_fps);
     }
     else
     {
@@ -621,10 +2313,13 @@ int main(int argc, char **argv)
     switch (mode)
     {
     case 'e':
-        encode(bytes_per_block);
+        encode(input_path, &roi, cpu_budget, control_path);
         break;
     case 'd':
-        decode(bytes_per_block);
+        decode(OUTPUT_RAW, control_path);
+        break;
+    case 'n':
+        decode(OUTPUT_NUT, control_path);
         break;
     default:
         fprintf(stderr, "Unknown mode\n");